@@ -14,23 +14,697 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "palmpdb.h"
 
 #define DEFAULT_ATTRIBUTES     0
 #define DEFAULT_REC_ATTRIBUTES 0
 
+/* What one database can hold: a 16-bit record count, and 32-bit offsets
+   past a 78-byte header and an 8-byte record list entry per record. */
+#define MAX_RECORDS  0xFFFF
+#define MAX_OFFSET   0xFFFFFFFFUL
+#define HEADER_SIZE  78
+#define ENTRY_SIZE   8UL
+
+/* Streamed output reads files ahead of the writer on -j threads, up to
+   this many files per thread ahead of it. With --chunk, only files up
+   to PRELOAD_MAX bytes are read ahead whole; bigger ones are still read
+   a chunk at a time as they're written. */
+#define READ_AHEAD_PER_THREAD  16
+#define PRELOAD_MAX            (256 * 1024UL)
+
+/* One input file, with the per-record options that were in effect
+   when it appeared on the command line. */
+typedef struct RecordJob {
+    const char* filename;
+    unsigned int attributes;
+    int terminate;
+    void* data;                 /* loaded contents; NULL if loading failed */
+    unsigned int length;
+    int truncated;              /* the file was longer than 64k */
+    unsigned long size;         /* bytes it takes in the database, when streamed */
+    unsigned int num_records;   /* records it takes then; 0 to skip it */
+    unsigned int shard;         /* and which database it goes in */
+    int ready;                  /* read ahead, or tried to be */
+} RecordJob;
+
+/* One 4k slice of PalmDOC text and its compressed form. */
+typedef struct TextJob {
+    const unsigned char* text;
+    unsigned int length;
+    unsigned char compressed[PDB_PALMDOC_MAX_COMPRESSED(PDB_PALMDOC_RECORD_SIZE)];
+    unsigned int compressed_length;
+} TextJob;
+
+typedef struct WorkQueue {
+    char* items;
+    size_t item_size;
+    int num_items;
+    int next;
+    void (*work)(void* item);
+    pthread_mutex_t lock;
+} WorkQueue;
+
+/* Reads the first limit bytes of a job's file, plus a terminator if
+   requested. Mirrors PDB_LoadRecordFromFile, but into a buffer of its own
+   so that any number of files can be read at once. */
+static void LoadFile(RecordJob* job, unsigned long limit)
+{
+    FILE* f;
+    long length;
+
+    f = fopen(job->filename, "rb");
+    if (f == NULL)
+	return;
+
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    if (length < 0) {
+	fclose(f);
+	return;
+    }
+    if ((unsigned long)length > limit) {
+	length = limit;
+	job->truncated = 1;
+    }
+    fseek(f, 0, SEEK_SET);
+
+    job->data = malloc(length + 1);
+    if (job->data != NULL && fread(job->data, 1, length, f) != (size_t)length) {
+	free(job->data);
+	job->data = NULL;
+    }
+    fclose(f);
+
+    if (job->data != NULL) {
+	job->length = length;
+	if (job->terminate) {
+	    ((char *)job->data)[length] = '\0';
+	    job->length++;
+	}
+    }
+}
+
+/* Reads the first 64k of a job's file: all a record holds. */
+static void LoadJob(void* item)
+{
+    LoadFile((RecordJob *)item, 0xFFFF);
+}
+
+static void CompressJob(void* item)
+{
+    TextJob* job = (TextJob *)item;
+
+    job->compressed_length = PDB_PalmDocCompress(job->text, job->length, job->compressed);
+}
+
+static void* Worker(void* arg)
+{
+    WorkQueue* queue = (WorkQueue *)arg;
+    int i;
+
+    for (;;) {
+	pthread_mutex_lock(&queue->lock);
+	i = queue->next++;
+	pthread_mutex_unlock(&queue->lock);
+	if (i >= queue->num_items)
+	    break;
+	queue->work(queue->items + i * queue->item_size);
+    }
+    return NULL;
+}
+
+/* Runs work on every item of an array, on up to num_threads threads. */
+static void RunJobs(void* items, size_t item_size, int num_items, void (*work)(void*), int num_threads)
+{
+    pthread_t* threads;
+    WorkQueue queue;
+    int i, started;
+
+    queue.items = (char *)items;
+    queue.item_size = item_size;
+    queue.num_items = num_items;
+    queue.next = 0;
+    queue.work = work;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    if (num_threads > num_items)
+	num_threads = num_items;
+    threads = (num_threads > 1 ? (pthread_t *)malloc(num_threads * sizeof (pthread_t)) : NULL);
+
+    /* Whatever threads can't be started, the calling thread makes up for. */
+    started = 0;
+    if (threads != NULL) {
+	for (i = 0; i < num_threads; i++) {
+	    if (pthread_create(&threads[started], NULL, Worker, &queue) == 0)
+		started++;
+	}
+    }
+    Worker(&queue);
+    for (i = 0; i < started; i++) {
+	pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+/* Loads a whole file, with no 64k limit, for PalmDOC text. */
+static void LoadText(void* item)
+{
+    RecordJob* job = (RecordJob *)item;
+    FILE* f;
+    long length;
+
+    f = fopen(job->filename, "rb");
+    if (f == NULL)
+	return;
+
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (length >= 0 && (unsigned long)length < 0xFFFFFFFF) {
+	job->data = malloc(length > 0 ? length : 1);
+	if (job->data != NULL && fread(job->data, 1, length, f) != (size_t)length) {
+	    free(job->data);
+	    job->data = NULL;
+	}
+	job->length = length;
+    }
+    fclose(f);
+}
+
+/* Joins the text of every input file, splits it into 4k records,
+   compresses them (in parallel with -j) and puts them after a PalmDOC
+   header in record 0. Frees the loaded files. */
+static int BuildPalmDoc(PDB* pdb, RecordJob* jobs, int num_jobs, int num_threads)
+{
+    unsigned char header[PDB_PALMDOC_HEADER_SIZE];
+    unsigned char* text;
+    unsigned long text_length = 0;
+    unsigned int num_text_records;
+    unsigned long compressed_length = PDB_PALMDOC_HEADER_SIZE;
+    TextJob* slices;
+    unsigned int i;
+    int j, result = -1;
+
+    for (j = 0; j < num_jobs; j++) {
+	if (jobs[j].data == NULL)
+	    printf("WARNING: unable to load text from '%s'.\n", jobs[j].filename);
+	else
+	    text_length += jobs[j].length;
+    }
+
+    num_text_records = (text_length + PDB_PALMDOC_RECORD_SIZE - 1) / PDB_PALMDOC_RECORD_SIZE;
+    if (num_text_records >= 0xFFFF) {
+	printf("ERROR: too much text for one PalmDOC database.\n");
+	return -1;
+    }
+
+    text = (unsigned char *)malloc(text_length > 0 ? text_length : 1);
+    slices = (TextJob *)malloc((num_text_records > 0 ? num_text_records : 1) * sizeof (TextJob));
+    if (text == NULL || slices == NULL)
+	goto done;
+
+    text_length = 0;
+    for (j = 0; j < num_jobs; j++) {
+	if (jobs[j].data != NULL) {
+	    memcpy(text + text_length, jobs[j].data, jobs[j].length);
+	    text_length += jobs[j].length;
+	}
+	free(jobs[j].data);
+	jobs[j].data = NULL;
+    }
+
+    for (i = 0; i < num_text_records; i++) {
+	slices[i].text = text + i * PDB_PALMDOC_RECORD_SIZE;
+	slices[i].length = (i + 1 < num_text_records ? PDB_PALMDOC_RECORD_SIZE :
+			    text_length - i * PDB_PALMDOC_RECORD_SIZE);
+    }
+    RunJobs(slices, sizeof (TextJob), num_text_records, CompressJob, num_threads);
+
+    if (PDB_SetNumRecords(pdb, num_text_records + 1) < 0)
+	goto done;
+    PDB_PalmDocHeader(header, text_length, num_text_records);
+    if (PDB_SetRecord(pdb, 0, header, sizeof (header), 0) < 0)
+	goto done;
+    for (i = 0; i < num_text_records; i++) {
+	if (PDB_SetRecord(pdb, i + 1, slices[i].compressed, slices[i].compressed_length, 0) < 0)
+	    goto done;
+	compressed_length += slices[i].compressed_length;
+    }
+
+    printf("PalmDOC text: %lu bytes in %u records, %lu bytes compressed.\n",
+	   text_length, num_text_records, compressed_length);
+    result = 0;
+
+ done:
+    free(slices);
+    free(text);
+    return result;
+}
+
+/* Reads an AppInfo or SortInfo block (what) from a file and sets it
+   with set. Only warns on trouble; the database goes without. */
+static void LoadBlock(PDB* pdb, const char* filename, const char* what,
+		      int (*set)(PDB*, const void*, unsigned int))
+{
+    FILE* f;
+    void* data;
+    unsigned int length;
+
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+	printf("WARNING: unable to open '%s'; not adding %s block.\n", filename, what);
+	return;
+    }
+
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    if (length > 0xFFFF) {
+	printf("WARNING: truncating %s block to 64k.\n", what);
+	length = 0xFFFF;
+    }
+    fseek(f, 0, SEEK_SET);
+    data = malloc(length);
+    if (data == NULL) {
+	printf("WARNING: unable to alloc %u bytes; not adding %s block.\n", length, what);
+	fclose(f);
+	return;
+    }
+    fread(data, length, 1, f);
+    fclose(f);
+    if (set(pdb, data, length) < 0) {
+	printf("WARNING: unable to set %s block.\n", what);
+	free(data);
+	return;
+    }
+
+    printf("%s block loaded from '%s', %u bytes.\n", what, filename, length);
+
+    free(data);
+}
+
+/* For --sort: the whole record is the key. */
+static const void* WholeRecord(const void* data, unsigned int length, unsigned int* key_length, void* ctx)
+{
+    (void)ctx;
+    *key_length = length;
+    return data;
+}
+
+/* Reads a stdio stream for PDB_WriterAddChunked. */
+static long FileRead(void* ctx, void* buf, unsigned long length)
+{
+    size_t got = fread(buf, 1, length, (FILE *)ctx);
+
+    return (got == 0 && ferror((FILE *)ctx) ? -1 : (long)got);
+}
+
+/* Reads a file read ahead into memory, for PDB_WriterAddChunked. */
+typedef struct MemStream {
+    const unsigned char* data;
+    unsigned long length;
+    unsigned long pos;
+} MemStream;
+
+static long MemRead(void* ctx, void* buf, unsigned long length)
+{
+    MemStream* mem = (MemStream *)ctx;
+
+    if (length > mem->length - mem->pos)
+	length = mem->length - mem->pos;
+    memcpy(buf, mem->data + mem->pos, length);
+    mem->pos += length;
+    return length;
+}
+
+/* Works out how many records and bytes a job takes: one record of up to
+   64k, or with chunk nonzero, the whole file in records of chunk bytes. */
+static int PlanJob(RecordJob* job, unsigned int chunk)
+{
+    unsigned long size;
+    struct stat st;
+
+    if (stat(job->filename, &st) != 0 || !S_ISREG(st.st_mode))
+	return -1;
+    size = st.st_size;
+    if (chunk == 0 && size > 0xFFFF) {
+	size = 0xFFFF;
+	job->truncated = 1;
+    }
+    if (job->terminate)
+	size++;
+    job->size = size;
+    if (chunk == 0)
+	job->num_records = 1;
+    else if (size / chunk >= MAX_RECORDS)
+	job->num_records = MAX_RECORDS + 1;    /* too many, however it's counted */
+    else
+	job->num_records = (size > 0 ? (size + chunk - 1) / chunk : 1);
+    return 0;
+}
+
+/* Adds one job to a database being written, reading the file a chunk at
+   a time, or whole if it's just the one record, unless it was read ahead.
+   Returns the number of records added, or -1. */
+static int StreamJob(PDB_Writer* w, RecordJob* job, unsigned int chunk)
+{
+    MemStream mem;
+    PDB_IO io;
+    FILE* f;
+    int count;
+
+    if (chunk == 0) {
+	if (job->data == NULL)
+	    LoadJob(job);
+	if (job->data == NULL)
+	    return -1;
+	count = PDB_WriterAddRecord(w, job->data, job->length, job->attributes);
+	free(job->data);
+	job->data = NULL;
+	return (count == 0 ? 1 : -1);
+    }
+
+    memset(&io, 0, sizeof (io));
+    if (job->data != NULL) {
+	/* A file that outgrew what was read ahead changed since it was
+	   planned, and would come out short. */
+	if (job->truncated)
+	    return 0;
+	mem.data = (const unsigned char *)job->data;
+	mem.length = job->length - (job->terminate ? 1 : 0);
+	mem.pos = 0;
+	io.read = MemRead;
+	io.ctx = &mem;
+	count = PDB_WriterAddChunked(w, &io, chunk, job->terminate, job->attributes);
+	free(job->data);
+	job->data = NULL;
+	return count;
+    }
+
+    f = fopen(job->filename, "rb");
+    if (f == NULL)
+	return -1;
+    io.read = FileRead;
+    io.ctx = f;
+    count = PDB_WriterAddChunked(w, &io, chunk, job->terminate, job->attributes);
+    fclose(f);
+    return count;
+}
+
+/* Files read ahead of the writer, in order, on a pool of threads. Readers
+   stay at most window files past the one being written, so only that
+   many are ever in memory. */
+typedef struct ReadAhead {
+    RecordJob* jobs;
+    int num_jobs;
+    unsigned int chunk;
+    int next;                   /* next file to read */
+    int written;                /* files the writer is done with */
+    int window;
+    int stop;
+    pthread_t* threads;
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t job_read;
+    pthread_cond_t job_written;
+} ReadAhead;
+
+static void* ReadAheadWorker(void* arg)
+{
+    ReadAhead* ra = (ReadAhead *)arg;
+    RecordJob* job;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop && ra->next < ra->num_jobs) {
+	if (ra->next >= ra->written + ra->window) {
+	    pthread_cond_wait(&ra->job_written, &ra->lock);
+	    continue;
+	}
+	job = &ra->jobs[ra->next++];
+	pthread_mutex_unlock(&ra->lock);
+
+	if (job->num_records > 0 && ra->chunk == 0)
+	    LoadFile(job, 0xFFFF);
+	else if (job->num_records > 0 && job->size <= PRELOAD_MAX)
+	    LoadFile(job, PRELOAD_MAX);
+
+	pthread_mutex_lock(&ra->lock);
+	job->ready = 1;
+	pthread_cond_broadcast(&ra->job_read);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/* Starts up to num_threads readers. With fewer than two, or if none can
+   be started, the writer reads every file itself. */
+static void ReadAheadStart(ReadAhead* ra, RecordJob* jobs, int num_jobs, unsigned int chunk, int num_threads)
+{
+    int i;
+
+    memset(ra, 0, sizeof (ReadAhead));
+    ra->jobs = jobs;
+    ra->num_jobs = num_jobs;
+    ra->chunk = chunk;
+    ra->window = num_threads * READ_AHEAD_PER_THREAD;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->job_read, NULL);
+    pthread_cond_init(&ra->job_written, NULL);
+
+    if (num_threads > num_jobs)
+	num_threads = num_jobs;
+    if (num_threads < 2)
+	return;
+    ra->threads = (pthread_t *)malloc(num_threads * sizeof (pthread_t));
+    if (ra->threads == NULL)
+	return;
+    for (i = 0; i < num_threads; i++) {
+	if (pthread_create(&ra->threads[ra->num_threads], NULL, ReadAheadWorker, ra) == 0)
+	    ra->num_threads++;
+    }
+}
+
+/* Waits until file i has been read ahead, if anyone is reading ahead. */
+static void ReadAheadWait(ReadAhead* ra, int i)
+{
+    if (ra->num_threads == 0)
+	return;
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->jobs[i].ready) {
+	pthread_cond_wait(&ra->job_read, &ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+/* Tells the readers the writer is done with every file before i. */
+static void ReadAheadWritten(ReadAhead* ra, int i)
+{
+    pthread_mutex_lock(&ra->lock);
+    ra->written = i;
+    pthread_cond_broadcast(&ra->job_written);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+/* Stops the readers, finished or not, and frees whatever they read that
+   was never written. */
+static void ReadAheadStop(ReadAhead* ra)
+{
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->job_written);
+    pthread_mutex_unlock(&ra->lock);
+    for (i = 0; i < ra->num_threads; i++) {
+	pthread_join(ra->threads[i], NULL);
+    }
+    for (i = 0; i < ra->num_jobs; i++) {
+	free(ra->jobs[i].data);
+	ra->jobs[i].data = NULL;
+    }
+    free(ra->threads);
+    pthread_cond_destroy(&ra->job_written);
+    pthread_cond_destroy(&ra->job_read);
+    pthread_mutex_destroy(&ra->lock);
+}
+
+/* Writes every job's records with PDB_Writer, one file at a time, so that
+   no input is ever whole in memory. Whatever doesn't fit in one database
+   goes on into more, numbered base.1.pdb, base.2.pdb and so on (base
+   being filename less any .pdb), each file whole in one of them. With
+   num_threads above 1, files are read ahead on that many threads. Then,
+   and whenever files are chunked, base.manifest lists the databases and
+   where each file's records are:
+     database <number> <filename> <records>
+     file <database number> <first record> <records> <bytes> <filename> */
+static int WriteStreamed(PDB* pdb, const char* filename, RecordJob* jobs, int num_jobs, unsigned int chunk,
+			 int num_threads)
+{
+    ReadAhead ra;
+    int reading = 0;
+    unsigned int* shard_records = NULL;
+    unsigned long shard_bytes = 0;
+    unsigned int num_shards = 1, s, first;
+    unsigned long base_bytes;
+    char* base = NULL;
+    char* name = NULL;
+    char suffix[16];
+    FILE* manifest = NULL;
+    PDB_Writer* w;
+    PDB header;
+    size_t length;
+    int i, count, result = -1;
+
+    shard_records = (unsigned int *)calloc(num_jobs + 1, sizeof (unsigned int));
+    length = strlen(filename);
+    base = (char *)malloc(length + 1);
+    name = (char *)malloc(length + 32);
+    if (shard_records == NULL || base == NULL || name == NULL) {
+	printf("ERROR: out of memory.\n");
+	goto done;
+    }
+    strcpy(base, filename);
+    if (length > 4 && !strcmp(base + length - 4, ".pdb"))
+	base[length - 4] = '\0';
+
+    /* Share out the files, in order, first come first served. */
+    base_bytes = HEADER_SIZE + pdb->app_info_length + pdb->sort_info_length;
+    for (i = 0; i < num_jobs; i++) {
+	RecordJob* job = &jobs[i];
+
+	job->shard = num_shards - 1;
+	if (PlanJob(job, chunk) < 0) {
+	    printf("WARNING: unable to load record from '%s'.\n", job->filename);
+	    job->num_records = 0;
+	    continue;
+	}
+	if (job->num_records > MAX_RECORDS ||
+	    base_bytes + job->num_records * ENTRY_SIZE + job->size > MAX_OFFSET) {
+	    printf("ERROR: '%s' is too big for one database%s.\n", job->filename,
+		   chunk > 0 && chunk < 0xFFFF ? "; try a bigger --chunk" : "");
+	    goto done;
+	}
+	if (shard_records[num_shards - 1] + job->num_records > MAX_RECORDS ||
+	    base_bytes + (shard_records[num_shards - 1] + job->num_records) * ENTRY_SIZE +
+	    shard_bytes + job->size > MAX_OFFSET) {
+	    num_shards++;
+	    shard_bytes = 0;
+	}
+	job->shard = num_shards - 1;
+	shard_records[job->shard] += job->num_records;
+	shard_bytes += job->size;
+    }
+
+    if (num_shards > 1 || chunk > 0) {
+	sprintf(name, "%s.manifest", base);
+	manifest = fopen(name, "w");
+	if (manifest == NULL) {
+	    printf("ERROR: unable to write '%s'.\n", name);
+	    goto done;
+	}
+	for (s = 0; s < num_shards; s++) {
+	    if (num_shards > 1)
+		sprintf(name, "%s.%u.pdb", base, s + 1);
+	    fprintf(manifest, "database %u %s %u\n", s + 1, num_shards > 1 ? name : filename,
+		    shard_records[s]);
+	}
+    }
+
+    /* Only now that every file is planned: readers go by the plan. */
+    ReadAheadStart(&ra, jobs, num_jobs, chunk, num_threads);
+    reading = 1;
+
+    i = 0;
+    for (s = 0; s < num_shards; s++) {
+	/* Each database gets its own name, as Palm OS needs. */
+	header = *pdb;
+	if (num_shards > 1) {
+	    sprintf(name, "%s.%u.pdb", base, s + 1);
+	    length = sprintf(suffix, " %u", s + 1);
+	    if (strlen(header.name) > 31 - length)
+		header.name[31 - length] = '\0';
+	    strcat(header.name, suffix);
+	} else {
+	    strcpy(name, filename);
+	}
+
+	w = PDB_WriterOpen(&header, name, shard_records[s]);
+	if (w == NULL) {
+	    printf("ERROR: unable to write '%s'.\n", name);
+	    goto done;
+	}
+	for (first = 0; i < num_jobs && jobs[i].shard == s; i++) {
+	    ReadAheadWritten(&ra, i);
+	    if (jobs[i].num_records == 0)
+		continue;
+	    ReadAheadWait(&ra, i);
+	    if (jobs[i].truncated && chunk == 0)
+		printf("WARNING: only the first 64k of '%s' will fit in a record; see --chunk.\n",
+		       jobs[i].filename);
+	    count = StreamJob(w, &jobs[i], chunk);
+	    if (count != (int)jobs[i].num_records) {
+		printf("ERROR: unable to add '%s'%s.\n", jobs[i].filename,
+		       count >= 0 ? "; it changed while being read" : "");
+		PDB_WriterClose(w);
+		goto done;
+	    }
+	    if (manifest != NULL)
+		fprintf(manifest, "file %u %u %u %lu %s\n", s + 1, first, count,
+			jobs[i].size, jobs[i].filename);
+	    first += count;
+	}
+	if (PDB_WriterClose(w) < 0) {
+	    printf("ERROR: unable to write '%s'.\n", name);
+	    goto done;
+	}
+    }
+    if (num_shards > 1)
+	printf("%u databases written, %s.1.pdb to %s.%u.pdb; see %s.manifest.\n",
+	       num_shards, base, base, num_shards, base);
+    result = 0;
+
+ done:
+    if (reading)
+	ReadAheadStop(&ra);
+    if (manifest != NULL && fclose(manifest) != 0 && result == 0) {
+	printf("ERROR: unable to write '%s.manifest'.\n", base);
+	result = -1;
+    }
+    free(name);
+    free(base);
+    free(shard_records);
+    return result;
+}
+
 int main(int argc, char *argv[])
 {
     unsigned int opt_rec_attributes = 0;
     int opt_terminate = 0, opt_sticky_terminate = 0;
+    int opt_jobs = 1;
+    int opt_palmdoc = 0;
+    int opt_sort = 0;
+    unsigned int opt_chunk = 0;
     int arg;
-    int rec = 0;
+    int rec;
+    RecordJob* jobs = NULL;
+    int num_jobs = 0, i;
     PDB pdb;
 
     if (argc < 2) {
 	goto usage;
     }
 
+    /* There can't be more input files than arguments. */
+    jobs = (RecordJob *)calloc(argc, sizeof (RecordJob));
+    if (jobs == NULL) {
+	printf("ERROR: out of memory.\n");
+	return EXIT_FAILURE;
+    }
+
     PDB_Init(&pdb, "None", 0, "NoNE", "NONE");
 
     for (arg = 2; arg < argc; arg++) {
@@ -63,44 +737,28 @@ int main(int argc, char *argv[])
 	    memset(pdb.type, 0, 4);
 	    strncpy(pdb.type, argv[arg], 4);
 	} else if (!strcmp(argv[arg], "--appinfo")) {
-	    FILE* f;
-	    void* data;
-	    unsigned int length;
-
 	    if (arg >= argc-1) goto usage;
 	    arg++;
-	    
-	    f = fopen(argv[arg], "rb");
-	    if (f == NULL) {
-		printf("WARNING: unable to open '%s'; not adding AppInfo block.\n", argv[arg]);
-		continue;
-	    }
-
-	    fseek(f, 0, SEEK_END);
-	    length = ftell(f);
-	    if (length > 0xFFFF) {
-		printf("WARNING: truncating AppInfo block to 64k.\n");
-		length = 0xFFFF;
-	    }
-	    fseek(f, 0, SEEK_SET);
-	    data = malloc(length);
-	    if (data == NULL) {
-		printf("WARNING: unable to alloc %u bytes; not adding AppInfo block.\n", length);
-		fclose(f);
-		continue;
-	    }
-	    fread(data, length, 1, f);
-	    fclose(f);
-	    if (PDB_SetAppInfoBlock(&pdb, data, length) < 0) {
-		printf("WARNING: unable to set AppInfo block.\n");
-		free(data);
-		continue;
-	    }
-
-	    printf("AppInfo block loaded from '%s', %u bytes.\n", argv[arg], length);
-	    
-	    free(data);
-
+	    LoadBlock(&pdb, argv[arg], "AppInfo", PDB_SetAppInfoBlock);
+	} else if (!strcmp(argv[arg], "--sortinfo")) {
+	    if (arg >= argc-1) goto usage;
+	    arg++;
+	    LoadBlock(&pdb, argv[arg], "SortInfo", PDB_SetSortInfoBlock);
+	} else if (!strcmp(argv[arg], "--sort")) {
+	    opt_sort = 1;
+	} else if (!strcmp(argv[arg], "--chunk")) {
+	    if (arg >= argc-1) goto usage;
+	    arg++;
+	    opt_chunk = strtoul(argv[arg], NULL, 10);
+	    if (opt_chunk < 1 || opt_chunk > 0xFFFF) goto usage;
+	} else if (!strcmp(argv[arg], "-j")) {
+	    if (arg >= argc-1) goto usage;
+	    arg++;
+	    opt_jobs = atoi(argv[arg]);
+	    if (opt_jobs < 1)
+		opt_jobs = 1;
+	} else if (!strcmp(argv[arg], "--palmdoc")) {
+	    opt_palmdoc = 1;
 	} else if (!strcmp(argv[arg], "--readonly")) {
 	    pdb.attributes |= PDB_ATTR_READONLY;
 	} else if (!strcmp(argv[arg], "--dirty-appinfo")) {
@@ -125,22 +783,95 @@ int main(int argc, char *argv[])
 	} else if (!strcmp(argv[arg], "+t")) {
 	    opt_terminate = 1;
 	} else {
-	    if (PDB_SetNumRecords(&pdb, rec+1) < 0) {
-		printf("WARNING: unable to resize record list. Skipping '%s'.\n", argv[arg]);
-		goto add_done;
-	    }
-	    if (PDB_LoadRecordFromFile(&pdb, rec, argv[arg], opt_terminate, opt_rec_attributes) < 0) {
-		printf("WARNING: unable to load record from '%s'.\n", argv[arg]);
-		goto add_done;
-	    }
-	    rec++;
-
-	add_done:
+	    jobs[num_jobs].filename = argv[arg];
+	    jobs[num_jobs].attributes = opt_rec_attributes;
+	    jobs[num_jobs].terminate = opt_terminate;
+	    num_jobs++;
 	    opt_rec_attributes = DEFAULT_REC_ATTRIBUTES;
 	    opt_terminate = opt_sticky_terminate;
 	}
     }
 
+    /* PalmDOC makes records of its own, 4k slices of the joined text, so
+       nothing that shapes records from files applies. */
+    if (opt_palmdoc) {
+	if (opt_chunk > 0)
+	    printf("WARNING: --chunk doesn't apply to --palmdoc, which makes 4k records; ignoring it.\n");
+	if (opt_sort)
+	    printf("WARNING: --sort would scramble PalmDOC text; not sorting.\n");
+	for (i = 0; i < num_jobs; i++) {
+	    if (jobs[i].terminate || jobs[i].attributes != DEFAULT_REC_ATTRIBUTES) {
+		printf("WARNING: per-record options (+s, +b, +d, +x, +t, --terminate) don't apply\n"
+		       "         to --palmdoc; ignoring them.\n");
+		break;
+	    }
+	}
+    }
+
+    if (!opt_palmdoc && (opt_chunk > 0 || num_jobs > MAX_RECORDS)) {
+	if (opt_sort)
+	    printf("WARNING: --sort is only for a single database of whole files; not sorting.\n");
+	arg = WriteStreamed(&pdb, argv[1], jobs, num_jobs, opt_chunk, opt_jobs);
+	free(jobs);
+	PDB_Free(&pdb);
+	return (arg == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    /* Files are read up front (in parallel with -j), then added as
+       records in command line order. */
+    RunJobs(jobs, sizeof (RecordJob), num_jobs, (opt_palmdoc ? LoadText : LoadJob), opt_jobs);
+
+    if (opt_palmdoc) {
+	/* Readers look for these, so they're the defaults here. */
+	if (!strcmp(pdb.type, "NoNE"))
+	    strcpy(pdb.type, "TEXt");
+	if (!strcmp(pdb.creator, "NONE"))
+	    strcpy(pdb.creator, "REAd");
+	if (BuildPalmDoc(&pdb, jobs, num_jobs, opt_jobs) < 0) {
+	    printf("ERROR: unable to build PalmDOC records.\n");
+	    PDB_Free(&pdb);
+	    return EXIT_FAILURE;
+	}
+	num_jobs = 0;           /* consumed */
+    }
+
+    /* One allocation for the whole record list. */
+    if (PDB_Reserve(&pdb, num_jobs) < 0) {
+	printf("ERROR: unable to allocate a list of %d records.\n", num_jobs);
+	PDB_Free(&pdb);
+	return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+	if (jobs[i].data == NULL) {
+	    printf("WARNING: unable to load record from '%s'.\n", jobs[i].filename);
+	    continue;
+	}
+	if (jobs[i].truncated)
+	    printf("WARNING: only the first 64k of '%s' fit in a record; see --chunk.\n",
+		   jobs[i].filename);
+	rec = PDB_AppendRecords(&pdb, 1);
+	if (rec < 0) {
+	    printf("WARNING: unable to resize record list. Skipping '%s'.\n", jobs[i].filename);
+	    continue;
+	}
+	/* The loaded buffer becomes the record as it is. */
+	if (PDB_AdoptRecord(&pdb, rec, jobs[i].data, jobs[i].length, jobs[i].attributes) < 0) {
+	    printf("WARNING: unable to load record from '%s'.\n", jobs[i].filename);
+	    PDB_SetNumRecords(&pdb, rec);
+	    continue;
+	}
+	jobs[i].data = NULL;
+    }
+
+    for (i = 0; i < num_jobs; i++) {
+	free(jobs[i].data);
+    }
+    free(jobs);
+
+    if (opt_sort && !opt_palmdoc && PDB_SortRecords(&pdb, WholeRecord, NULL) < 0)
+	printf("WARNING: unable to sort records; leaving them in command line order.\n");
+
     if (PDB_WriteFile(&pdb, argv[1]) < 0) {
 	printf("ERROR: unable to write PDB file.\n");
 	PDB_Free(&pdb);
@@ -156,7 +887,8 @@ int main(int argc, char *argv[])
 	   "  Generates Palm PDB databases from arbitrary files.\n"
 	   "  Any number of arguments can be interleaved with any number of files.\n"
 	   "  Each file will be added to the database as a separate record.\n"
-	   "  Files longer than 65535 bytes will be truncated to fit.\n"
+	   "  Files longer than 65535 bytes will be truncated to fit, unless --chunk\n"
+	   "  is given. More than 65535 records are split across several databases.\n"
 	   "  At the very least, you should probably provide the name, creator,\n"
 	   "  and type attributes; most of the others have sane defaults.\n\n"
 	   "Arguments:\n"
@@ -169,8 +901,9 @@ int main(int argc, char *argv[])
 	   "                        If no time is given, the current time is used.\n"
 	   "    --mtime <seconds>   time of last modification\n"
 	   "    --btime <seconds>   time of last backup (often zero)\n"
-	   "\n  AppInfo block:\n"
+	   "\n  AppInfo and SortInfo blocks:\n"
 	   "    --appinfo <file>    reads an AppInfo block from the given file\n"
+	   "    --sortinfo <file>   reads a SortInfo block from the given file\n"
 	   "\n  Database attributes:\n"
 	   "    --readonly          makes the database read-only\n"
 	   "    --dirty-appinfo     flags the AppInfo block as modified\n"
@@ -179,6 +912,26 @@ int main(int argc, char *argv[])
 	   "    --copy-prevent      marks this database as copy protected (not very secure)\n"
 	   "\n  Null termination:\n"
 	   "    --terminate         adds a null terminator (\\0) to every record in this database\n"
+	   "\n  PalmDOC e-texts:\n"
+	   "    --palmdoc           joins all input files into one text, split into\n"
+	   "                        compressed 4k records behind a PalmDOC header.\n"
+	   "                        Type and creator default to TEXt and REAd.\n"
+	   "                        --chunk, --sort and the per-record options\n"
+	   "                        don't apply, and are ignored with a warning.\n"
+	   "\n  Record order:\n"
+	   "    --sort              sorts the records by their contents, byte by byte,\n"
+	   "                        so they can be binary searched\n"
+	   "\n  Large inputs:\n"
+	   "    --chunk <bytes>     splits every file, however long, across as many\n"
+	   "                        records of this size (up to 65535) as it takes.\n"
+	   "                        Files are streamed, not read into memory first.\n"
+	   "    Whatever doesn't fit in one database (65535 records, 4GB) goes into\n"
+	   "    several: filename.1.pdb, filename.2.pdb... With either, a manifest,\n"
+	   "    filename.manifest, says which records of which database hold each file.\n"
+	   "\n  Performance:\n"
+	   "    -j <threads>        reads (and compresses) input on this many threads (default 1)\n"
+	   "                        With --chunk or several databases, files are read\n"
+	   "                        ahead of the writer, whole if they're small enough.\n"
 	   "\n  Per-record attributes (cleared to defaults between every file):\n"
 	   "    +s         secret record\n"
 	   "    +b         record is busy (not usually set)\n"
@@ -17,374 +17,4177 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef PDB_IO_URING
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "palmpdb.h"
 
-#if (BYTE_ORDER == LITTLE_ENDIAN)
-#define SWAP_BE_16(u16) (((u16 & 0xFF00) >> 8) + ((u16 & 0xFF) << 8))
-#define SWAP_LE_16(u16) (u16)
-#define SWAP_BE_32(u32) (((u32 & 0xFF000000) >> 24) + ((u32 & 0x00FF0000) >> 8) + ((u32 & 0x0000FF00) << 8) + ((u32 & 0x000000FF) << 24))
-#define SWAP_LE_32(u32) (u32)
+#ifndef IOV_MAX
+#define IOV_MAX 1024   /* the POSIX minimum is 16, but Linux and the BSDs take 1024 */
+#endif
+
+#define PDB_HEADER_SIZE  78
+#define PDB_ENTRY_SIZE    8   /* record list entry: offset, attributes, unique ID */
+#define PDB_RES_ENTRY_SIZE 10  /* resource list entry: type, ID, offset */
+
+/* Instrumentation. Off by default; while it's off, each counter is a
+   single test of stats_enabled. The counters are shared by every
+   database in the process and updated atomically, so threads loading
+   databases side by side all add to the same totals. */
+
+static int stats_enabled;
+static PDB_Stats stats;
+
+#define STAT_ADD(field, n) \
+    do { if (stats_enabled) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED); } while (0)
+
+static unsigned long StatClock(void)
+{
+    struct timespec ts;
+
+    if (!stats_enabled)
+	return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Adds the time since start, as returned by StatClock, to a timer. */
+#define STAT_TIME(field, start) STAT_ADD(field, StatClock() - (start))
+
+void PDB_EnableStats(int enable)
+{
+    stats_enabled = enable;
+}
+
+void PDB_GetStats(PDB_Stats* out)
+{
+    unsigned long* src = (unsigned long *)&stats;
+    unsigned long* dst = (unsigned long *)out;
+    unsigned int i;
+
+    for (i = 0; i < sizeof (PDB_Stats) / sizeof (unsigned long); i++) {
+	dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+void PDB_ResetStats(void)
+{
+    unsigned long* p = (unsigned long *)&stats;
+    unsigned int i;
+
+    for (i = 0; i < sizeof (PDB_Stats) / sizeof (unsigned long); i++) {
+	__atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Every allocation in the library goes through these, so it's counted. */
+static void* Malloc(size_t size)
+{
+    STAT_ADD(malloc_calls, 1);
+    STAT_ADD(bytes_allocated, size);
+    return malloc(size);
+}
+
+static void* Calloc(size_t count, size_t size)
+{
+    STAT_ADD(malloc_calls, 1);
+    STAT_ADD(bytes_allocated, count * size);
+    return calloc(count, size);
+}
+
+static void* Realloc(void* ptr, size_t size)
+{
+    STAT_ADD(realloc_calls, 1);
+    STAT_ADD(bytes_allocated, size);
+    return realloc(ptr, size);
+}
+
+static unsigned int GetBE16(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 8) | p[1];
+}
+
+static unsigned int GetBE32(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+	((unsigned int)p[2] << 8) | p[3];
+}
+
+static void PutBE16(unsigned char* p, unsigned int val)
+{
+    p[0] = (val >> 8) & 0xFF;
+    p[1] = val & 0xFF;
+}
+
+static void PutBE32(unsigned char* p, unsigned int val)
+{
+    p[0] = (val >> 24) & 0xFF;
+    p[1] = (val >> 16) & 0xFF;
+    p[2] = (val >> 8) & 0xFF;
+    p[3] = val & 0xFF;
+}
+
+static int InBlock(const void* base, unsigned int length, const void* ptr)
+{
+    const unsigned char* b = (const unsigned char *)base;
+    const unsigned char* p = (const unsigned char *)ptr;
+
+    return (b != NULL && p >= b && p <= b + length);
+}
+
+/* Returns nonzero if ptr points into the database's file mapping or its
+   read arena, in which case it must not be passed to free() or realloc(). */
+static int IsShared(const struct PDB* pdb, const void* ptr)
+{
+    return (InBlock(pdb->map_base, pdb->map_length, ptr) ||
+	    InBlock(pdb->arena, pdb->arena_length, ptr));
+}
+
+static void FreeData(struct PDB* pdb, void* ptr)
+{
+    if (!IsShared(pdb, ptr))
+	free(ptr);
+}
+
+/* Lets go of a record's data however it's held: handed back to its
+   owner if borrowed, freed if the record's own, else left alone. */
+static void ReleaseRecord(struct PDB* pdb, PDB_Record* r)
+{
+    if (r->release != NULL)
+	r->release(r->data, r->release_ctx);
+    else
+	FreeData(pdb, r->data);
+    r->data = NULL;
+    r->release = NULL;
+    r->release_ctx = NULL;
+}
+
+
+static unsigned int EntrySize(unsigned int attributes)
+{
+    return ((attributes & PDB_ATTR_RESOURCE) ? PDB_RES_ENTRY_SIZE : PDB_ENTRY_SIZE);
+}
+
+/* Locates the data offset field of list entry rec, going by the database
+   attributes in the packed header in front of the list. */
+static unsigned int OffsetField(const unsigned char* index, unsigned int rec)
+{
+    unsigned int attributes = GetBE16(index + 32);
+
+    return PDB_HEADER_SIZE + rec * EntrySize(attributes) +
+	((attributes & PDB_ATTR_RESOURCE) ? 6 : 0);
+}
+
+static unsigned int EntryOffset(const unsigned char* index, unsigned int rec)
+{
+    return GetBE32(index + OffsetField(index, rec));
+}
+
+static void SetEntryOffset(unsigned char* index, unsigned int rec, unsigned int offset)
+{
+    PutBE32(index + OffsetField(index, rec), offset);
+}
+
+/* Hands out the next unique ID from the database's seed. IDs are 24 bits
+   and zero is never used. */
+static unsigned int NextUID(struct PDB* pdb)
+{
+    pdb->unique_id_seed = (pdb->unique_id_seed + 1) & 0xFFFFFF;
+    if (pdb->unique_id_seed == 0)
+	pdb->unique_id_seed = 1;
+    return pdb->unique_id_seed;
+}
+
+/* Reads exactly length bytes at the given file offset. */
+static int ReadAt(int fd, void* buf, unsigned int length, off_t offset)
+{
+    while (length > 0) {
+	ssize_t got = pread(fd, buf, length, offset);
+	STAT_ADD(read_calls, 1);
+	if (got < 0 && errno == EINTR)
+	    continue;
+	if (got <= 0)
+	    return -1;
+	STAT_ADD(bytes_read, got);
+	buf = (char *)buf + got;
+	length -= got;
+	offset += got;
+    }
+    return 0;
+}
+
+/* Counted wrappers for the stdio calls made by the streaming writer.
+   These count library calls into stdio, which buffers, rather than
+   system calls. */
+static int WriteStream(FILE* f, const void* data, size_t length)
+{
+    STAT_ADD(write_calls, 1);
+    if (fwrite(data, length, 1, f) != 1)
+	return -1;
+    STAT_ADD(bytes_written, length);
+    return 0;
+}
+
+static size_t ReadStream(FILE* f, void* buf, size_t length)
+{
+    size_t got = fread(buf, 1, length, f);
+
+    STAT_ADD(read_calls, 1);
+    STAT_ADD(bytes_read, got);
+    return got;
+}
+
+static int SeekStream(FILE* f, long offset, int whence)
+{
+    STAT_ADD(seek_calls, 1);
+    return fseek(f, offset, whence);
+}
+
+/* Reads the header and the complete record list of an open file into a
+   malloc'd buffer, ready for ParseIndex. Returns NULL on failure. */
+static unsigned char* ReadIndex(int fd, unsigned int* file_length)
+{
+    unsigned char header[PDB_HEADER_SIZE];
+    unsigned char* index;
+    unsigned long start;
+    unsigned int size;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < PDB_HEADER_SIZE || st.st_size > 0xFFFFFFFF)
+	return NULL;
+    *file_length = st.st_size;
+
+    start = StatClock();
+    if (ReadAt(fd, header, PDB_HEADER_SIZE, 0) != 0)
+	return NULL;
+    STAT_TIME(header_parse_ns, start);
+
+    size = PDB_HEADER_SIZE + GetBE16(header + 76) * EntrySize(GetBE16(header + 32));
+    if (size > *file_length)
+	return NULL;
+
+    start = StatClock();
+    index = (unsigned char *)Malloc(size);
+    if (index == NULL)
+	return NULL;
+    memcpy(index, header, PDB_HEADER_SIZE);
+    if (ReadAt(fd, index + PDB_HEADER_SIZE, size - PDB_HEADER_SIZE, PDB_HEADER_SIZE) != 0) {
+	free(index);
+	return NULL;
+    }
+    STAT_TIME(index_parse_ns, start);
+    return index;
+}
+
+/* Packs the 78-byte database header. The AppInfo block starts at
+   app_info_offset, and the SortInfo block, if any, right after it;
+   0 points at neither. */
+static void PackHeader(const struct PDB* pdb, unsigned char* buf, unsigned int app_info_offset)
+{
+    memcpy(buf, pdb->name, 32);
+    PutBE16(buf + 32, pdb->attributes);
+    PutBE16(buf + 34, pdb->version);
+    PutBE32(buf + 36, pdb->creation_time);
+    PutBE32(buf + 40, pdb->modification_time);
+    PutBE32(buf + 44, pdb->backup_time);
+    /* modification number: always set to zero */
+    PutBE32(buf + 48, 0);
+    /* appinfo area: the appinfo area is always the first item of data,
+       if it exists */
+    PutBE32(buf + 52, app_info_offset);
+    /* sortinfo area: straight after the appinfo area */
+    PutBE32(buf + 56, (pdb->sort_info_length > 0 && app_info_offset != 0 ?
+		       app_info_offset + pdb->app_info_length : 0));
+    /* type and creator: 4 bytes each, not terminated */
+    memcpy(buf + 60, pdb->type, 4);
+    memcpy(buf + 64, pdb->creator, 4);
+    PutBE32(buf + 68, pdb->unique_id_seed);
+    /* next record list ID: only for the in memory representation */
+    PutBE32(buf + 72, 0);
+    PutBE16(buf + 76, pdb->num_records);
+}
+
+/* Packs one record list entry, or resource list entry for resource
+   databases. */
+static void PackEntry(const struct PDB* pdb, unsigned char* buf, unsigned int offset, const struct PDB_Record* rec)
+{
+    if (pdb->attributes & PDB_ATTR_RESOURCE) {
+	memcpy(buf, rec->resource_type, 4);
+	PutBE16(buf + 4, rec->resource_id);
+	PutBE32(buf + 6, offset);
+	return;
+    }
+
+    PutBE32(buf, offset);
+    buf[4] = rec->attributes;
+    /* unique ID: 3 bytes */
+    buf[5] = (rec->unique_id >> 16) & 0xFF;
+    buf[6] = (rec->unique_id >> 8) & 0xFF;
+    buf[7] = rec->unique_id & 0xFF;
+}
+
+/* Writes out an array of buffers with writev, coping with short writes
+   and with more buffers than the kernel accepts in one call. */
+static int WriteVec(int fd, struct iovec* iov, unsigned int count)
+{
+    while (count > 0) {
+	int batch = (count > IOV_MAX ? IOV_MAX : count);
+	ssize_t done = writev(fd, iov, batch);
+	STAT_ADD(write_calls, 1);
+	if (done < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	STAT_ADD(bytes_written, done);
+	/* Skip over whatever was fully written. */
+	while (count > 0 && (size_t)done >= iov->iov_len) {
+	    done -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	if (done > 0) {
+	    iov->iov_base = (char *)iov->iov_base + done;
+	    iov->iov_len -= done;
+	}
+    }
+    return 0;
+}
+
+/* Packs the header and the whole record list into one malloc'd buffer,
+   laid out for the AppInfo block and the record bodies to follow it
+   directly. Returns NULL if out of memory, or if the database has more
+   records than the 16-bit count holds or more data than 32-bit offsets
+   reach. */
+static unsigned char* PackIndex(const struct PDB* pdb, unsigned int* data_start)
+{
+    unsigned int entry_size = EntrySize(pdb->attributes);
+    unsigned long total;
+    unsigned int cur_start;
+    unsigned char* index;
+    unsigned int i;
+
+    if (pdb->num_records > 0xFFFF)
+	return NULL;
+    total = PDB_HEADER_SIZE + (unsigned long)pdb->num_records * entry_size +
+	pdb->app_info_length + pdb->sort_info_length;
+    for (i = 0; i < pdb->num_records && total <= 0xFFFFFFFF; i++) {
+	total += pdb->records[i].length;
+    }
+    if (total > 0xFFFFFFFF)
+	return NULL;
+
+    *data_start = PDB_HEADER_SIZE + pdb->num_records * entry_size;
+    index = (unsigned char *)Malloc(*data_start);
+    if (index == NULL)
+	return NULL;
+
+    PackHeader(pdb, index, *data_start);
+
+    cur_start = *data_start + pdb->app_info_length + pdb->sort_info_length;
+    for (i = 0; i < pdb->num_records; i++) {
+	PackEntry(pdb, index + PDB_HEADER_SIZE + i * entry_size, cur_start, &pdb->records[i]);
+	cur_start += pdb->records[i].length;
+    }
+    return index;
+}
+
+int PDB_WriteFile(struct PDB* pdb, const char* filename)
+{
+    unsigned char* index = NULL;
+    struct iovec* iov = NULL;
+    unsigned int data_start;
+    unsigned int count = 0;
+    unsigned long clock;
+    unsigned int i;
+    int fd = -1, result = -1;
+
+    /* Checked before the file is opened, which truncates it. */
+    if (pdb->header_only)
+	return -1;
+
+    /* The packed header and record list are sent along with the AppInfo
+       block and every record body in as few writev calls as possible. */
+    index = PackIndex(pdb, &data_start);
+    iov = (struct iovec *)Malloc((pdb->num_records + 3) * sizeof (struct iovec));
+    if (index == NULL || iov == NULL)
+	goto done;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+	goto done;
+
+    clock = StatClock();
+    iov[count].iov_base = index;
+    iov[count++].iov_len = data_start;
+
+    if (pdb->app_info_length != 0) {
+	iov[count].iov_base = pdb->app_info_block;
+	iov[count++].iov_len = pdb->app_info_length;
+    }
+    if (pdb->sort_info_length != 0) {
+	iov[count].iov_base = pdb->sort_info_block;
+	iov[count++].iov_len = pdb->sort_info_length;
+    }
+
+    for (i = 0; i < pdb->num_records; i++) {
+	void* data = pdb->records[i].data;
+	if (pdb->records[i].length == 0)
+	    continue;
+	if (data == NULL && pdb->lazy != NULL) {
+	    /* Loading a record may evict others from the cache, so send
+	       everything gathered so far before fetching it. */
+	    if (WriteVec(fd, iov, count) != 0)
+		goto done;
+	    count = 0;
+	    data = (void *)PDB_GetRecordData(pdb, i);
+	    if (data == NULL)
+		goto done;
+	}
+	iov[count].iov_base = data;
+	iov[count++].iov_len = pdb->records[i].length;
+    }
+
+    result = WriteVec(fd, iov, count);
+    STAT_TIME(body_store_ns, clock);
+
+ done:
+    if (fd >= 0 && close(fd) != 0)
+	result = -1;
+    free(iov);
+    free(index);
+    return result;
+}
+
+struct PDB_Writer {
+    FILE* f;                    /* the database being written */
+    FILE* spill;                /* record bodies, if no count was declared */
+    struct PDB pdb;             /* header fields and copies of the AppInfo and SortInfo blocks */
+    unsigned char* index;       /* header and record list, packed */
+    unsigned int max_records;
+    unsigned int num_records;
+    unsigned int capacity;      /* entries the index buffer has room for */
+    unsigned int cur_start;     /* offset of the next record body */
+    unsigned int entry_size;
+    int failed;
+};
+
+/* Writes the AppInfo and SortInfo blocks, if any, at the current position. */
+static int WriterBlocks(PDB_Writer* w)
+{
+    if (w->pdb.app_info_length != 0 &&
+	WriteStream(w->f, w->pdb.app_info_block, w->pdb.app_info_length) != 0)
+	return -1;
+    if (w->pdb.sort_info_length != 0 &&
+	WriteStream(w->f, w->pdb.sort_info_block, w->pdb.sort_info_length) != 0)
+	return -1;
+    return 0;
+}
+
+PDB_Writer* PDB_WriterOpen(const struct PDB* pdb, const char* filename, unsigned int max_records)
+{
+    PDB_Writer* w;
+
+    if (max_records > 0xFFFF || pdb->header_only)
+	return NULL;
+
+    w = (PDB_Writer *)Calloc(1, sizeof (PDB_Writer));
+    if (w == NULL)
+	return NULL;
+
+    memcpy(w->pdb.name, pdb->name, sizeof (w->pdb.name));
+    w->pdb.attributes = pdb->attributes;
+    w->pdb.version = pdb->version;
+    w->pdb.creation_time = pdb->creation_time;
+    w->pdb.modification_time = pdb->modification_time;
+    w->pdb.backup_time = pdb->backup_time;
+    w->pdb.unique_id_seed = pdb->unique_id_seed;
+    memcpy(w->pdb.type, pdb->type, sizeof (w->pdb.type));
+    memcpy(w->pdb.creator, pdb->creator, sizeof (w->pdb.creator));
+    if (PDB_SetAppInfoBlock(&w->pdb, pdb->app_info_block, pdb->app_info_length) != 0 ||
+	PDB_SetSortInfoBlock(&w->pdb, pdb->sort_info_block, pdb->sort_info_length) != 0)
+	goto error;
+
+    w->max_records = max_records;
+    w->capacity = (max_records > 0 ? max_records : 64);
+    w->entry_size = EntrySize(w->pdb.attributes);
+    w->index = (unsigned char *)Calloc(PDB_HEADER_SIZE + w->capacity * w->entry_size, 1);
+    if (w->index == NULL)
+	goto error;
+    /* Packed now so the entries can be located; redone on close. */
+    PackHeader(&w->pdb, w->index, 0);
+
+    w->f = fopen(filename, "wb");
+    if (w->f == NULL)
+	goto error;
+
+    if (max_records > 0) {
+	/* Leave room for the header and the full record list; the
+	   bodies start right after it and the AppInfo and SortInfo blocks. */
+	w->cur_start = PDB_HEADER_SIZE + max_records * w->entry_size;
+	if (SeekStream(w->f, w->cur_start, SEEK_SET) != 0 || WriterBlocks(w) != 0)
+	    goto error;
+	w->cur_start += w->pdb.app_info_length + w->pdb.sort_info_length;
+    } else {
+	/* Offsets are relative to the spool until the count is known. */
+	w->spill = tmpfile();
+	if (w->spill == NULL)
+	    goto error;
+    }
+
+    return w;
+
+ error:
+    if (w->f != NULL)
+	fclose(w->f);
+    PDB_Free(&w->pdb);
+    free(w->index);
+    free(w);
+    return NULL;
+}
+
+static int WriterAdd(PDB_Writer* w, const void* data, unsigned int length, PDB_Record* rec)
+{
+    unsigned long start;
+
+    if (w->num_records == (w->max_records > 0 ? w->max_records : 0xFFFF) ||
+	length > 0xFFFFFFFF - w->cur_start)
+	return -1;
+
+    if (w->num_records == w->capacity) {
+	unsigned int capacity = w->capacity * 2;
+	unsigned char* index;
+	if (capacity > 0xFFFF)
+	    capacity = 0xFFFF;
+	index = (unsigned char *)Realloc(w->index, PDB_HEADER_SIZE + capacity * w->entry_size);
+	if (index == NULL)
+	    return -1;
+	w->index = index;
+	w->capacity = capacity;
+    }
+
+    start = StatClock();
+    if (length != 0 && WriteStream(w->spill != NULL ? w->spill : w->f, data, length) != 0) {
+	/* Part of the body may have gone out; the file can't be trusted. */
+	w->failed = 1;
+	return -1;
+    }
+    STAT_TIME(body_store_ns, start);
+
+    PackEntry(&w->pdb, w->index + PDB_HEADER_SIZE + w->num_records * w->entry_size, w->cur_start, rec);
+    w->cur_start += length;
+    w->num_records++;
+
+    return 0;
+}
+
+int PDB_WriterAddRecord(PDB_Writer* w, const void* data, unsigned int length, unsigned int attr)
+{
+    PDB_Record rec;
+
+    if (w->pdb.attributes & PDB_ATTR_RESOURCE)
+	return -1;
+
+    memset(&rec, 0, sizeof (rec));
+    rec.attributes = attr;
+    rec.unique_id = NextUID(&w->pdb);
+    return WriterAdd(w, data, length, &rec);
+}
+
+int PDB_WriterAddResource(PDB_Writer* w, const char* type, unsigned int id, const void* data, unsigned int length)
+{
+    PDB_Record rec;
+
+    if (!(w->pdb.attributes & PDB_ATTR_RESOURCE))
+	return -1;
+
+    memset(&rec, 0, sizeof (rec));
+    strncpy(rec.resource_type, type, 4);
+    rec.resource_id = id;
+    return WriterAdd(w, data, length, &rec);
+}
+
+int PDB_WriterClose(PDB_Writer* w)
+{
+    unsigned long start;
+    unsigned int data_start;
+    unsigned int app_info_offset;
+    unsigned int i;
+    int result = (w->failed ? -1 : 0);
+
+    w->pdb.num_records = w->num_records;
+
+    if (w->spill != NULL) {
+	char buf[16384];
+	size_t got;
+
+	/* Shift the spooled offsets past the record list and the AppInfo
+	   and SortInfo blocks, then copy the bodies in behind them. */
+	data_start = PDB_HEADER_SIZE + w->num_records * w->entry_size;
+	if ((unsigned long)w->cur_start + data_start + w->pdb.app_info_length +
+	    w->pdb.sort_info_length > 0xFFFFFFFF)
+	    result = -1;
+	for (i = 0; i < w->num_records; i++) {
+	    SetEntryOffset(w->index, i, EntryOffset(w->index, i) + data_start +
+			   w->pdb.app_info_length + w->pdb.sort_info_length);
+	}
+	PackHeader(&w->pdb, w->index, data_start);
+
+	if (WriteStream(w->f, w->index, data_start) != 0 || WriterBlocks(w) != 0)
+	    result = -1;
+
+	rewind(w->spill);
+	STAT_ADD(seek_calls, 1);
+	start = StatClock();
+	while (result == 0 && (got = ReadStream(w->spill, buf, sizeof (buf))) > 0) {
+	    if (WriteStream(w->f, buf, got) != 0)
+		result = -1;
+	}
+	STAT_TIME(body_store_ns, start);
+	if (ferror(w->spill))
+	    result = -1;
+	fclose(w->spill);
+    } else {
+	/* Without either block, a nonzero AppInfo offset in front of
+	   unused entries would make readers take the padding for one. */
+	data_start = PDB_HEADER_SIZE + w->max_records * w->entry_size;
+	app_info_offset = data_start;
+	if (w->pdb.app_info_length == 0 && w->pdb.sort_info_length == 0 && w->num_records < w->max_records)
+	    app_info_offset = 0;
+	PackHeader(&w->pdb, w->index, app_info_offset);
+
+	if (SeekStream(w->f, 0, SEEK_SET) != 0 || WriteStream(w->f, w->index, data_start) != 0)
+	    result = -1;
+    }
+
+    if (fclose(w->f) != 0)
+	result = -1;
+
+    w->pdb.num_records = 0;       /* only the count was borrowed for PackHeader */
+    PDB_Free(&w->pdb);
+    free(w->index);
+    free(w);
+    return result;
+}
+
+/* Unpacks the 78-byte header, less the unique ID seed, which must only
+   be set once the records exist. Returns the number of records. */
+static unsigned int UnpackHeader(struct PDB* pdb, const unsigned char* buf, unsigned int* app_info_offset,
+				 unsigned int* sort_info_offset)
+{
+    memcpy(pdb->name, buf, 32);
+    pdb->name[31] = '\0';         /* don't trust that there's already one there */
+    pdb->attributes = GetBE16(buf + 32);
+    pdb->version = GetBE16(buf + 34);
+    pdb->creation_time = GetBE32(buf + 36);
+    pdb->modification_time = GetBE32(buf + 40);
+    pdb->backup_time = GetBE32(buf + 44);
+    /* modification number at 48; don't care */
+    *app_info_offset = GetBE32(buf + 52);
+    *sort_info_offset = GetBE32(buf + 56);
+    memcpy(pdb->type, buf + 60, 4);
+    memcpy(pdb->creator, buf + 64, 4);
+    /* next record list ID at 72; don't care */
+    return GetBE16(buf + 76);
+}
+
+/* Unpacks what PackEntry packed into a record, all but its length and
+   data. Returns the offset field. */
+static unsigned int UnpackEntry(const struct PDB* pdb, const unsigned char* buf, struct PDB_Record* rec)
+{
+    if (pdb->attributes & PDB_ATTR_RESOURCE) {
+	memcpy(rec->resource_type, buf, 4);
+	rec->resource_type[4] = '\0';
+	rec->resource_id = GetBE16(buf + 4);
+	rec->unique_id = 0;
+	return GetBE32(buf + 6);
+    }
+
+    rec->attributes = buf[4];
+    rec->unique_id = ((unsigned int)buf[5] << 16) | (buf[6] << 8) | buf[7];
+    return GetBE32(buf);
+}
+
+/* Parses the header and record list at the start of index, which must
+   hold at least that much. file_length is the size of the whole file, and
+   every offset is checked against it, so a truncated or corrupt file is
+   rejected rather than read out of bounds. Fills in everything except the
+   data pointers; record i starts at EntryOffset(index, i). */
+static int ParseIndex(struct PDB* pdb, const unsigned char* index, unsigned int file_length,
+		      unsigned int* app_info_offset, unsigned int* sort_info_offset)
+{
+    const unsigned char* entry;
+    unsigned long start = StatClock();
+    unsigned int num_records;
+    unsigned int data_start;
+    unsigned int prev, next, end;
+    unsigned int i;
+
+    if (file_length < PDB_HEADER_SIZE)
+	return -1;
+
+    num_records = UnpackHeader(pdb, index, app_info_offset, sort_info_offset);
+    STAT_TIME(header_parse_ns, start);
+
+    start = StatClock();
+    data_start = PDB_HEADER_SIZE + num_records * EntrySize(pdb->attributes);
+    if (data_start > file_length)
+	return -1;
+
+    if (PDB_SetNumRecords(pdb, num_records) != 0)
+	return -1;
+
+    /* Read after the records exist, so handing out IDs to them doesn't
+       disturb it. */
+    pdb->unique_id_seed = GetBE32(index + 68);
+
+    /* Each record runs up to the next record's offset, and the last one
+       runs to the end of the file. */
+    entry = index + PDB_HEADER_SIZE;
+    prev = (num_records > 0 ? EntryOffset(index, 0) : file_length);
+    if (prev < data_start || prev > file_length)
+	return -1;
+
+    /* The AppInfo and SortInfo blocks each run up to whichever comes
+       next of the other one and the first record. */
+    if (*app_info_offset != 0) {
+	if (*app_info_offset < data_start || *app_info_offset > prev)
+	    return -1;
+	end = (*sort_info_offset >= *app_info_offset ? *sort_info_offset : prev);
+	if (end > prev)
+	    return -1;
+	pdb->app_info_length = end - *app_info_offset;
+    }
+    if (*sort_info_offset != 0) {
+	if (*sort_info_offset < data_start || *sort_info_offset > prev)
+	    return -1;
+	end = (*app_info_offset > *sort_info_offset ? *app_info_offset : prev);
+	pdb->sort_info_length = end - *sort_info_offset;
+    }
+
+    for (i = 0; i < num_records; i++) {
+	next = (i + 1 < num_records ? EntryOffset(index, i + 1) : file_length);
+	if (next < prev || next > file_length)
+	    return -1;
+	pdb->records[i].length = next - prev;
+	UnpackEntry(pdb, entry, &pdb->records[i]);
+	entry += EntrySize(pdb->attributes);
+	prev = next;
+    }
+
+    STAT_TIME(index_parse_ns, start);
+    return 0;
+}
+
+/* Where the payload starts: the AppInfo block, the SortInfo block or the
+   first record, whichever comes first. */
+static unsigned int PayloadStart(const struct PDB* pdb, const unsigned char* index, unsigned int file_length,
+				 unsigned int app_info_offset, unsigned int sort_info_offset)
+{
+    unsigned int start = (pdb->num_records > 0 ? EntryOffset(index, 0) : file_length);
+
+    if (app_info_offset != 0 && app_info_offset < start)
+	start = app_info_offset;
+    if (sort_info_offset != 0 && sort_info_offset < start)
+	start = sort_info_offset;
+    return start;
+}
+
+/* Parses a complete PDB image held in memory. Record data and the AppInfo
+   and SortInfo blocks are left pointing into the buffer. */
+static int ParseBuffer(struct PDB* pdb, const unsigned char* buf, unsigned int length)
+{
+    unsigned int app_info_offset, sort_info_offset;
+    unsigned int i;
+
+    if (ParseIndex(pdb, buf, length, &app_info_offset, &sort_info_offset) != 0)
+	return -1;
+
+    if (app_info_offset != 0)
+	pdb->app_info_block = (void *)(buf + app_info_offset);
+    if (sort_info_offset != 0)
+	pdb->sort_info_block = (void *)(buf + sort_info_offset);
+
+    for (i = 0; i < pdb->num_records; i++) {
+	pdb->records[i].data = (void *)(buf + EntryOffset(buf, i));
+    }
+
+    return 0;
+}
+
+int PDB_ReadFile(struct PDB* pdb, const char* filename)
+{
+    unsigned char* index = NULL;
+    unsigned char* arena;
+    unsigned int file_length;
+    unsigned int app_info_offset, sort_info_offset;
+    unsigned int start;
+    unsigned int i;
+    int fd;
+
+    memset(pdb, 0, sizeof (struct PDB));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+
+    index = ReadIndex(fd, &file_length);
+    if (index == NULL || ParseIndex(pdb, index, file_length, &app_info_offset, &sort_info_offset) != 0)
+	goto error;
+
+    /* Everything from the AppInfo block (or the first record) to the end
+       of the file is payload. It is read with a single call into one
+       allocation, and records point into it rather than each getting
+       their own malloc. */
+    start = PayloadStart(pdb, index, file_length, app_info_offset, sort_info_offset);
+
+    if (file_length > start) {
+	unsigned long clock = StatClock();
+	arena = (unsigned char *)Malloc(file_length - start);
+	if (arena == NULL)
+	    goto error;
+	pdb->arena = arena;
+	pdb->arena_length = file_length - start;
+	if (ReadAt(fd, arena, pdb->arena_length, start) != 0)
+	    goto error;
+	STAT_TIME(body_load_ns, clock);
+
+	if (pdb->app_info_length > 0)
+	    pdb->app_info_block = arena + (app_info_offset - start);
+	if (pdb->sort_info_length > 0)
+	    pdb->sort_info_block = arena + (sort_info_offset - start);
+	for (i = 0; i < pdb->num_records; i++) {
+	    pdb->records[i].data = arena + (EntryOffset(index, i) - start);
+	}
+    }
+
+    close(fd);
+    free(index);
+    return 0;
+
+ error:
+    close(fd);
+    free(index);
+    PDB_Free(pdb);
+    return -1;
+}
+
+int PDB_ReadHeader(struct PDB* pdb, const char* filename)
+{
+    unsigned char* index;
+    unsigned int file_length;
+    unsigned int app_info_offset, sort_info_offset;
+    int fd, result = -1;
+
+    memset(pdb, 0, sizeof (struct PDB));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+
+    index = ReadIndex(fd, &file_length);
+    if (index != NULL && ParseIndex(pdb, index, file_length, &app_info_offset, &sort_info_offset) == 0)
+	result = 0;
+
+    close(fd);
+    free(index);
+    if (result != 0)
+	PDB_Free(pdb);
+    else
+	pdb->header_only = 1;
+    return result;
+}
+
+int PDB_MapFile(struct PDB* pdb, const char* filename)
+{
+    struct stat st;
+    void* base;
+    int fd;
+
+    memset(pdb, 0, sizeof (struct PDB));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+
+    if (fstat(fd, &st) != 0 || st.st_size < PDB_HEADER_SIZE || st.st_size > 0xFFFFFFFF) {
+	close(fd);
+	return -1;
+    }
+
+    /* Private and writable, so callers that scribble on record data in
+       place get their own copy of the page instead of a fault. */
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+	return -1;
+
+    pdb->map_base = base;
+    pdb->map_length = st.st_size;
+
+    if (ParseBuffer(pdb, (const unsigned char *)base, pdb->map_length) != 0) {
+	PDB_Unmap(pdb);
+	return -1;
+    }
+
+    return 0;
+}
+
+void PDB_Unmap(struct PDB* pdb)
+{
+    PDB_Free(pdb);
+}
+
+/* Reads exactly length bytes from a caller's stream. */
+static int IORead(const PDB_IO* io, void* buf, unsigned int length)
+{
+    while (length > 0) {
+	long got = io->read(io->ctx, buf, length);
+	STAT_ADD(read_calls, 1);
+	if (got <= 0)
+	    return -1;
+	STAT_ADD(bytes_read, got);
+	buf = (char *)buf + got;
+	length -= got;
+    }
+    return 0;
+}
+
+/* Writes exactly length bytes to a caller's stream. */
+static int IOWrite(const PDB_IO* io, const void* buf, unsigned int length)
+{
+    while (length > 0) {
+	long done = io->write(io->ctx, buf, length);
+	STAT_ADD(write_calls, 1);
+	if (done <= 0)
+	    return -1;
+	STAT_ADD(bytes_written, done);
+	buf = (const char *)buf + done;
+	length -= done;
+    }
+    return 0;
+}
+
+/* Moves a stream forward from pos to target, by seeking if the stream
+   can, otherwise by reading and throwing away. */
+static int IOSkip(const PDB_IO* io, unsigned int pos, unsigned int target)
+{
+    char buf[4096];
+    unsigned int chunk;
+
+    if (io->seek != NULL) {
+	STAT_ADD(seek_calls, 1);
+	return io->seek(io->ctx, target);
+    }
+    if (target < pos)
+	return -1;
+    for (; pos < target; pos += chunk) {
+	chunk = (target - pos > sizeof (buf) ? sizeof (buf) : target - pos);
+	if (IORead(io, buf, chunk) != 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/* Reads a stream of unknown length to its end into one malloc'd buffer. */
+static unsigned char* IOReadAll(const PDB_IO* io, unsigned int* length)
+{
+    unsigned int capacity = 65536, used = 0;
+    unsigned char* buf;
+    unsigned char* new_buf;
+    long got;
+
+    buf = (unsigned char *)Malloc(capacity);
+    if (buf == NULL)
+	return NULL;
+
+    for (;;) {
+	if (used == capacity) {
+	    if (capacity > 0x7FFFFFFF)
+		goto error;
+	    capacity *= 2;
+	    new_buf = (unsigned char *)Realloc(buf, capacity);
+	    if (new_buf == NULL)
+		goto error;
+	    buf = new_buf;
+	}
+	got = io->read(io->ctx, buf + used, capacity - used);
+	STAT_ADD(read_calls, 1);
+	if (got < 0)
+	    goto error;
+	if (got == 0)
+	    break;
+	STAT_ADD(bytes_read, got);
+	used += got;
+    }
+
+    *length = used;
+    return buf;
+
+ error:
+    free(buf);
+    return NULL;
+}
+
+int PDB_ReadIO(struct PDB* pdb, const PDB_IO* io)
+{
+    unsigned char header[PDB_HEADER_SIZE];
+    unsigned char* index = NULL;
+    unsigned char* arena;
+    unsigned int file_length;
+    unsigned int app_info_offset, sort_info_offset;
+    unsigned int index_size;
+    unsigned int start;
+    unsigned long clock;
+    unsigned int i;
+    long size;
+
+    memset(pdb, 0, sizeof (struct PDB));
+
+    size = (io->size != NULL ? io->size(io->ctx) : -1);
+    if (size < 0) {
+	/* No length to check offsets against until the end is reached, so
+	   take the whole stream and parse it where it lies. */
+	arena = IOReadAll(io, &file_length);
+	if (arena == NULL)
+	    return -1;
+	pdb->arena = arena;
+	pdb->arena_length = file_length;
+	if (ParseBuffer(pdb, arena, file_length) != 0)
+	    goto error;
+	return 0;
+    }
+
+    /* Otherwise the same as PDB_ReadFile, front to back: header, record
+       list, then everything from the first data byte into one arena. */
+    if (size < PDB_HEADER_SIZE || (unsigned long)size > 0xFFFFFFFF)
+	return -1;
+    file_length = size;
+
+    if (IORead(io, header, PDB_HEADER_SIZE) != 0)
+	return -1;
+    index_size = PDB_HEADER_SIZE + GetBE16(header + 76) * EntrySize(GetBE16(header + 32));
+    if (index_size > file_length)
+	return -1;
+    index = (unsigned char *)Malloc(index_size);
+    if (index == NULL)
+	return -1;
+    memcpy(index, header, PDB_HEADER_SIZE);
+    if (IORead(io, index + PDB_HEADER_SIZE, index_size - PDB_HEADER_SIZE) != 0 ||
+	ParseIndex(pdb, index, file_length, &app_info_offset, &sort_info_offset) != 0)
+	goto error;
+
+    start = PayloadStart(pdb, index, file_length, app_info_offset, sort_info_offset);
+
+    if (file_length > start) {
+	clock = StatClock();
+	if (IOSkip(io, index_size, start) != 0)
+	    goto error;
+	arena = (unsigned char *)Malloc(file_length - start);
+	if (arena == NULL)
+	    goto error;
+	pdb->arena = arena;
+	pdb->arena_length = file_length - start;
+	if (IORead(io, arena, pdb->arena_length) != 0)
+	    goto error;
+	STAT_TIME(body_load_ns, clock);
+
+	if (pdb->app_info_length > 0)
+	    pdb->app_info_block = arena + (app_info_offset - start);
+	if (pdb->sort_info_length > 0)
+	    pdb->sort_info_block = arena + (sort_info_offset - start);
+	for (i = 0; i < pdb->num_records; i++) {
+	    pdb->records[i].data = arena + (EntryOffset(index, i) - start);
+	}
+    }
+
+    free(index);
+    return 0;
+
+ error:
+    free(index);
+    PDB_Free(pdb);
+    return -1;
+}
+
+int PDB_WriteIO(struct PDB* pdb, const PDB_IO* io)
+{
+    unsigned char* index;
+    unsigned int data_start;
+    unsigned long clock;
+    unsigned int i;
+    int result = -1;
+
+    if (pdb->header_only)
+	return -1;
+    index = PackIndex(pdb, &data_start);
+    if (index == NULL)
+	return -1;
+
+    clock = StatClock();
+    if (IOWrite(io, index, data_start) != 0 ||
+	IOWrite(io, pdb->app_info_block, pdb->app_info_length) != 0 ||
+	IOWrite(io, pdb->sort_info_block, pdb->sort_info_length) != 0)
+	goto done;
+    for (i = 0; i < pdb->num_records; i++) {
+	const void* data = PDB_GetRecordData(pdb, i);
+	if (pdb->records[i].length > 0 &&
+	    (data == NULL || IOWrite(io, data, pdb->records[i].length) != 0))
+	    goto done;
+    }
+    STAT_TIME(body_store_ns, clock);
+    result = 0;
+
+ done:
+    free(index);
+    return result;
+}
+
+int PDB_ReadMemory(struct PDB* pdb, const void* buf, unsigned int length)
+{
+    unsigned char* arena;
+
+    memset(pdb, 0, sizeof (struct PDB));
+
+    /* One copy of the whole image, parsed in place. The caller's buffer
+       is not referenced afterwards. */
+    arena = (unsigned char *)Malloc(length > 0 ? length : 1);
+    if (arena == NULL)
+	return -1;
+    memcpy(arena, buf, length);
+    pdb->arena = arena;
+    pdb->arena_length = length;
+
+    if (ParseBuffer(pdb, arena, length) != 0) {
+	PDB_Free(pdb);
+	return -1;
+    }
+    return 0;
+}
+
+int PDB_WriteMemory(struct PDB* pdb, void** buf, unsigned int* length)
+{
+    unsigned char* index;
+    unsigned char* image;
+    unsigned char* p;
+    unsigned int data_start;
+    unsigned int total;
+    unsigned int i;
+
+    if (pdb->header_only)
+	return -1;
+    index = PackIndex(pdb, &data_start);
+    if (index == NULL)
+	return -1;
+
+    total = data_start + pdb->app_info_length + pdb->sort_info_length;
+    for (i = 0; i < pdb->num_records; i++) {
+	total += pdb->records[i].length;
+    }
+
+    image = (unsigned char *)Malloc(total);
+    if (image == NULL) {
+	free(index);
+	return -1;
+    }
+
+    memcpy(image, index, data_start);
+    p = image + data_start;
+    if (pdb->app_info_length > 0) {
+	memcpy(p, pdb->app_info_block, pdb->app_info_length);
+	p += pdb->app_info_length;
+    }
+    if (pdb->sort_info_length > 0) {
+	memcpy(p, pdb->sort_info_block, pdb->sort_info_length);
+	p += pdb->sort_info_length;
+    }
+    for (i = 0; i < pdb->num_records; i++) {
+	const void* data;
+	if (pdb->records[i].length == 0)
+	    continue;
+	data = PDB_GetRecordData(pdb, i);
+	if (data == NULL) {
+	    free(image);
+	    free(index);
+	    return -1;
+	}
+	memcpy(p, data, pdb->records[i].length);
+	p += pdb->records[i].length;
+    }
+
+    free(index);
+    *buf = image;
+    *length = total;
+    return 0;
+}
+
+/* Writes exactly length bytes at the given file offset. */
+static int WriteAt(int fd, const void* buf, unsigned int length, off_t offset)
+{
+    while (length > 0) {
+	ssize_t done = pwrite(fd, buf, length, offset);
+	STAT_ADD(write_calls, 1);
+	if (done < 0 && errno == EINTR)
+	    continue;
+	if (done <= 0)
+	    return -1;
+	STAT_ADD(bytes_written, done);
+	buf = (const char *)buf + done;
+	length -= done;
+	offset += done;
+    }
+    return 0;
+}
+
+/* Moves the bytes in [from, end) of a file so they start at to, copying
+   from the far end first when moving up so nothing is overwritten early. */
+static int MoveRange(int fd, unsigned int from, unsigned int end, unsigned int to)
+{
+    char buf[32768];
+    unsigned int chunk, pos;
+
+    if (to > from) {
+	for (pos = end; pos > from; ) {
+	    chunk = (pos - from > sizeof (buf) ? sizeof (buf) : pos - from);
+	    pos -= chunk;
+	    if (ReadAt(fd, buf, chunk, pos) != 0 || WriteAt(fd, buf, chunk, pos + (to - from)) != 0)
+		return -1;
+	}
+    } else {
+	for (pos = from; pos < end; pos += chunk) {
+	    chunk = (end - pos > sizeof (buf) ? sizeof (buf) : end - pos);
+	    if (ReadAt(fd, buf, chunk, pos) != 0 || WriteAt(fd, buf, chunk, pos - (from - to)) != 0)
+		return -1;
+	}
+    }
+    return 0;
+}
+
+int PDB_UpdateRecordInFile(const char* filename, unsigned int rec, const void* data, unsigned int length, unsigned int attr)
+{
+    struct PDB pdb;
+    unsigned char* index = NULL;
+    unsigned int file_length;
+    unsigned int app_info_offset, sort_info_offset;
+    unsigned int start, old_end, new_end;
+    unsigned int patch_start, patch_end;
+    unsigned long clock;
+    unsigned int i;
+    int fd, result = -1;
+
+    memset(&pdb, 0, sizeof (pdb));
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+	return -1;
+
+    /* Only the header and record list are read, to validate the offsets
+       and find the record. */
+    index = ReadIndex(fd, &file_length);
+    if (index == NULL || ParseIndex(&pdb, index, file_length, &app_info_offset, &sort_info_offset) != 0)
+	goto done;
+    if (rec >= pdb.num_records)
+	goto done;
+
+    start = EntryOffset(index, rec);
+    old_end = start + pdb.records[rec].length;
+    new_end = start + length;
+    if (new_end < start || file_length - old_end > 0xFFFFFFFF - new_end)
+	goto done;
+
+    /* The span of the record list that needs writing back. A record's
+       attribute byte is always rewritten (resources have none)... */
+    patch_start = patch_end = OffsetField(index, rec + 1);
+    if (!(pdb.attributes & PDB_ATTR_RESOURCE)) {
+	patch_start = OffsetField(index, rec) + 4;
+	patch_end = patch_start + 1;
+	index[patch_start] = attr;
+    }
+
+    clock = StatClock();
+    if (new_end != old_end) {
+	/* ...and a resize moves everything after the record, so the
+	   offsets of all the following records change too. */
+	if (MoveRange(fd, old_end, file_length, new_end) != 0)
+	    goto done;
+	if (new_end < old_end && ftruncate(fd, file_length - (old_end - new_end)) != 0)
+	    goto done;
+	for (i = rec + 1; i < pdb.num_records; i++) {
+	    SetEntryOffset(index, i, EntryOffset(index, i) - old_end + new_end);
+	    patch_end = OffsetField(index, i) + 4;
+	}
+    }
+
+    if (WriteAt(fd, data, length, start) != 0)
+	goto done;
+    if (patch_end > patch_start &&
+	WriteAt(fd, index + patch_start, patch_end - patch_start, patch_start) != 0)
+	goto done;
+    STAT_TIME(body_store_ns, clock);
+
+    result = 0;
+
+ done:
+    if (close(fd) != 0)
+	result = -1;
+    free(index);
+    PDB_Free(&pdb);
+    return result;
+}
+
+#define LAZY_NONE 0xFFFFFFFF
+
+enum {
+    LAZY_ON_DISK,   /* not loaded; data is NULL */
+    LAZY_CACHED,    /* loaded, on the LRU list, may be evicted */
+    LAZY_RESIDENT,  /* replaced by the caller; never evicted */
+    LAZY_BATCHED    /* part of a PDB_FetchBatch in progress; off the LRU list */
+};
+
+struct PDB_Lazy {
+    int fd;
+    unsigned int num_records;   /* records backed by the file */
+    unsigned int* offsets;      /* file offset of each of them */
+    unsigned int* prev;         /* LRU links toward the head... */
+    unsigned int* next;         /* ...and toward the tail */
+    unsigned char* state;
+    unsigned int head, tail;    /* most and least recently used */
+    unsigned int cache_bytes;
+    unsigned int cache_used;
+    uint64_t* hashes;           /* each one's hash, from a sidecar index; or NULL */
+};
+
+static void LazyUnlink(struct PDB_Lazy* lazy, unsigned int rec)
+{
+    if (lazy->prev[rec] != LAZY_NONE)
+	lazy->next[lazy->prev[rec]] = lazy->next[rec];
+    else
+	lazy->head = lazy->next[rec];
+    if (lazy->next[rec] != LAZY_NONE)
+	lazy->prev[lazy->next[rec]] = lazy->prev[rec];
+    else
+	lazy->tail = lazy->prev[rec];
+}
+
+static void LazyPushHead(struct PDB_Lazy* lazy, unsigned int rec)
+{
+    lazy->prev[rec] = LAZY_NONE;
+    lazy->next[rec] = lazy->head;
+    if (lazy->head != LAZY_NONE)
+	lazy->prev[lazy->head] = rec;
+    else
+	lazy->tail = rec;
+    lazy->head = rec;
+}
+
+/* Evicts least recently used records until length more bytes fit in the
+   budget. A record bigger than the whole budget still gets loaded, alone. */
+static void LazyMakeRoom(struct PDB* pdb, unsigned int length)
+{
+    struct PDB_Lazy* lazy = pdb->lazy;
+
+    while (lazy->tail != LAZY_NONE && lazy->cache_used + length > lazy->cache_bytes) {
+	unsigned int victim = lazy->tail;
+	LazyUnlink(lazy, victim);
+	lazy->cache_used -= pdb->records[victim].length;
+	lazy->state[victim] = LAZY_ON_DISK;
+	free(pdb->records[victim].data);
+	pdb->records[victim].data = NULL;
+    }
+}
+
+/* Called before a record's data is replaced or freed by the caller:
+   from then on records[rec].data is authoritative. */
+static void LazyForget(struct PDB* pdb, unsigned int rec)
+{
+    struct PDB_Lazy* lazy = pdb->lazy;
+
+    if (lazy == NULL || rec >= lazy->num_records)
+	return;
+    if (lazy->state[rec] == LAZY_CACHED) {
+	LazyUnlink(lazy, rec);
+	lazy->cache_used -= pdb->records[rec].length;
+    }
+    lazy->state[rec] = LAZY_RESIDENT;
+}
+
+/* Sets up the loader for a database whose index has been parsed, with
+   record i at EntryOffset(index, i). Takes over fd. */
+static int LazyAttach(struct PDB* pdb, int fd, const unsigned char* index, unsigned int cache_bytes)
+{
+    struct PDB_Lazy* lazy;
+    unsigned int num_records = pdb->num_records;
+    unsigned int i;
+
+    /* The bookkeeping arrays share one allocation with the loader. */
+    lazy = (struct PDB_Lazy *)Malloc(sizeof (struct PDB_Lazy) +
+				     num_records * (3 * sizeof (unsigned int) + 1));
+    if (lazy == NULL)
+	return -1;
+    lazy->fd = fd;
+    lazy->num_records = num_records;
+    lazy->offsets = (unsigned int *)(lazy + 1);
+    lazy->prev = lazy->offsets + num_records;
+    lazy->next = lazy->prev + num_records;
+    lazy->state = (unsigned char *)(lazy->next + num_records);
+    lazy->head = lazy->tail = LAZY_NONE;
+    lazy->cache_bytes = cache_bytes;
+    lazy->cache_used = 0;
+    lazy->hashes = NULL;
+    pdb->lazy = lazy;
+
+    for (i = 0; i < num_records; i++) {
+	lazy->offsets[i] = EntryOffset(index, i);
+	lazy->state[i] = LAZY_ON_DISK;
+    }
+    return 0;
+}
+
+/* The AppInfo and SortInfo blocks are small and almost always wanted,
+   so a lazy database loads them up front. */
+static int LazyLoadBlocks(struct PDB* pdb, unsigned int app_info_offset, unsigned int sort_info_offset)
+{
+    if (pdb->app_info_length > 0) {
+	pdb->app_info_block = Malloc(pdb->app_info_length);
+	if (pdb->app_info_block == NULL ||
+	    ReadAt(pdb->lazy->fd, pdb->app_info_block, pdb->app_info_length, app_info_offset) != 0)
+	    return -1;
+    }
+    if (pdb->sort_info_length > 0) {
+	pdb->sort_info_block = Malloc(pdb->sort_info_length);
+	if (pdb->sort_info_block == NULL ||
+	    ReadAt(pdb->lazy->fd, pdb->sort_info_block, pdb->sort_info_length, sort_info_offset) != 0)
+	    return -1;
+    }
+    return 0;
+}
+
+int PDB_OpenLazy(struct PDB* pdb, const char* filename, unsigned int cache_bytes)
+{
+    unsigned char* index = NULL;
+    unsigned int file_length;
+    unsigned int app_info_offset, sort_info_offset;
+    int fd;
+
+    memset(pdb, 0, sizeof (struct PDB));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+
+    index = ReadIndex(fd, &file_length);
+    if (index == NULL || ParseIndex(pdb, index, file_length, &app_info_offset, &sort_info_offset) != 0 ||
+	LazyAttach(pdb, fd, index, cache_bytes) != 0 ||
+	LazyLoadBlocks(pdb, app_info_offset, sort_info_offset) != 0)
+	goto error;
+
+    free(index);
+    return 0;
+
+ error:
+    if (pdb->lazy == NULL)
+	close(fd);
+    free(index);
+    PDB_Free(pdb);
+    return -1;
+}
+
+const void* PDB_GetRecordData(struct PDB* pdb, unsigned int rec)
+{
+    struct PDB_Lazy* lazy = pdb->lazy;
+    unsigned long start;
+    PDB_Record* r;
+    void* data;
+
+    if (rec >= pdb->num_records)
+	return NULL;
+
+    r = &pdb->records[rec];
+    if (lazy == NULL || rec >= lazy->num_records || lazy->state[rec] == LAZY_RESIDENT)
+	return r->data;
+
+    if (lazy->state[rec] == LAZY_CACHED) {
+	LazyUnlink(lazy, rec);
+	LazyPushHead(lazy, rec);
+	return r->data;
+    }
+
+    /* Make room first, so the record being loaded isn't the one evicted. */
+    LazyMakeRoom(pdb, r->length);
+
+    start = StatClock();
+    data = Malloc(r->length > 0 ? r->length : 1);
+    if (data == NULL)
+	return NULL;
+    if (ReadAt(lazy->fd, data, r->length, lazy->offsets[rec]) != 0) {
+	free(data);
+	return NULL;
+    }
+    STAT_TIME(body_load_ns, start);
+
+    r->data = data;
+    lazy->state[rec] = LAZY_CACHED;
+    lazy->cache_used += r->length;
+    LazyPushHead(lazy, rec);
+    return data;
+}
+
+/* One record body read of a batch fetch. */
+typedef struct FetchRead {
+    int fd;
+    void* buf;
+    unsigned int length;
+    unsigned int offset;
+    int result;                 /* 1 while outstanding, then 0 or -1 */
+    unsigned int request;       /* the PDB_FetchRequest it's for */
+} FetchRead;
+
+static void FetchReadsSync(FetchRead* reads, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+	reads[i].result = ReadAt(reads[i].fd, reads[i].buf, reads[i].length, reads[i].offset);
+    }
+}
+
+#ifdef PDB_IO_URING
+
+/* Batched reads through io_uring, driven with the raw system calls so
+   there's nothing extra to link. A ring is set up for each batch; that
+   costs a few microseconds, next to the milliseconds a cold batch takes. */
+
+#define RING_ENTRIES 128
+
+typedef struct Ring {
+    int fd;
+    unsigned int entries;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Ring;
+
+static void RingClose(Ring* ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+	munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+	munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static int RingOpen(Ring* ring, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof (Ring));
+    memset(&p, 0, sizeof (p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+	return -1;
+
+    ring->entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_ring_size > ring->sq_ring_size)
+	    ring->sq_ring_size = ring->cq_ring_size;
+	ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+	goto error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	ring->cq_ring = ring->sq_ring;
+    } else {
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+	    goto error;
+    }
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+					     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+	goto error;
+
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return 0;
+
+ error:
+    RingClose(ring);
+    return -1;
+}
+
+/* Keeps up to a ring's worth of reads in flight until all are done.
+   Short or failed reads are finished off with pread. Returns -1 without
+   having read anything if io_uring can't be used, e.g. on old kernels
+   or under a seccomp policy that blocks it. */
+static int FetchReadsRing(FetchRead* reads, unsigned int count)
+{
+    unsigned int submitted = 0, completed = 0, in_flight = 0;
+    unsigned int tail, head, to_submit, i;
+    int failed = 0;
+    Ring ring;
+    int ret;
+
+    if (RingOpen(&ring, count < RING_ENTRIES ? count : RING_ENTRIES) != 0)
+	return -1;
+
+    tail = *ring.sq_tail;
+    while (completed < count) {
+	while (!failed && submitted < count && in_flight < ring.entries) {
+	    unsigned int slot = tail & *ring.sq_mask;
+	    struct io_uring_sqe* sqe = &ring.sqes[slot];
+
+	    memset(sqe, 0, sizeof (*sqe));
+	    sqe->opcode = IORING_OP_READ;
+	    sqe->fd = reads[submitted].fd;
+	    sqe->addr = (unsigned long)reads[submitted].buf;
+	    sqe->len = reads[submitted].length;
+	    sqe->off = reads[submitted].offset;
+	    sqe->user_data = submitted;
+	    ring.sq_array[slot] = slot;
+	    STAT_ADD(read_calls, 1);
+	    tail++;
+	    submitted++;
+	    in_flight++;
+	}
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	/* Everything the kernel hasn't consumed yet, which includes
+	   entries a previous call stopped short of. */
+	to_submit = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	do {
+	    ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && !failed) {
+	    /* Take back the entries the kernel never consumed and leave
+	       them to pread. Those it did take still write into our
+	       buffers, so keep reaping until they're all accounted for. */
+	    unsigned int unconsumed = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	    tail -= unconsumed;
+	    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+	    submitted -= unconsumed;
+	    in_flight -= unconsumed;
+	    failed = 1;
+	}
+
+	head = *ring.cq_head;
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+	    struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+	    FetchRead* r = &reads[cqe->user_data];
+	    unsigned int got = (cqe->res > 0 ? cqe->res : 0);
+
+	    STAT_ADD(bytes_read, got);
+	    if (got == r->length)
+		r->result = 0;
+	    else
+		r->result = ReadAt(r->fd, (char *)r->buf + got, r->length - got, r->offset + got);
+	    head++;
+	    completed++;
+	    in_flight--;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+	if (failed) {
+	    if (in_flight == 0)
+		break;
+	    if (ret < 0)
+		sched_yield();  /* can't wait in the kernel; poll instead */
+	}
+    }
+
+    /* After a failure, pread whatever the ring never got to. */
+    for (i = 0; i < count; i++) {
+	if (reads[i].result == 1)
+	    reads[i].result = ReadAt(reads[i].fd, reads[i].buf, reads[i].length, reads[i].offset);
+    }
+
+    RingClose(&ring);
+    return 0;
+}
+
+#endif
+
+int PDB_FetchBatch(PDB_FetchRequest* requests, unsigned int count)
+{
+    FetchRead* reads;
+    unsigned int num_reads = 0;
+    unsigned long start;
+    unsigned int i;
+    int result = 0;
+
+    reads = (FetchRead *)Malloc((count > 0 ? count : 1) * sizeof (FetchRead));
+    if (reads == NULL)
+	return -1;
+
+    /* Work out what actually needs reading and allocate for it. Everything
+       asked for is taken off the LRU list while the batch runs, so making
+       room for one record can't evict another from the same batch. */
+    for (i = 0; i < count; i++) {
+	struct PDB* pdb = requests[i].pdb;
+	struct PDB_Lazy* lazy = pdb->lazy;
+	unsigned int rec = requests[i].rec;
+	PDB_Record* r;
+	void* data;
+
+	requests[i].result = 0;
+	if (rec >= pdb->num_records) {
+	    requests[i].result = -1;
+	    continue;
+	}
+	if (lazy == NULL || rec >= lazy->num_records)
+	    continue;
+	if (lazy->state[rec] == LAZY_CACHED) {
+	    LazyUnlink(lazy, rec);
+	    lazy->state[rec] = LAZY_BATCHED;
+	}
+	if (lazy->state[rec] != LAZY_ON_DISK)
+	    continue;
+
+	r = &pdb->records[rec];
+	LazyMakeRoom(pdb, r->length);
+	data = Malloc(r->length > 0 ? r->length : 1);
+	if (data == NULL) {
+	    requests[i].result = -1;
+	    continue;
+	}
+	r->data = data;
+	lazy->state[rec] = LAZY_BATCHED;
+	lazy->cache_used += r->length;
+
+	reads[num_reads].fd = lazy->fd;
+	reads[num_reads].buf = data;
+	reads[num_reads].length = r->length;
+	reads[num_reads].offset = lazy->offsets[rec];
+	reads[num_reads].result = 1;
+	reads[num_reads].request = i;
+	num_reads++;
+    }
+
+    start = StatClock();
+#ifdef PDB_IO_URING
+    if (num_reads < 2 || FetchReadsRing(reads, num_reads) != 0)
+	FetchReadsSync(reads, num_reads);
+#else
+    FetchReadsSync(reads, num_reads);
+#endif
+    STAT_TIME(body_load_ns, start);
+
+    /* Failed reads go back to disk... */
+    for (i = 0; i < num_reads; i++) {
+	PDB_FetchRequest* req = &requests[reads[i].request];
+	if (reads[i].result != 0) {
+	    free(reads[i].buf);
+	    req->pdb->records[req->rec].data = NULL;
+	    req->pdb->lazy->cache_used -= reads[i].length;
+	    req->pdb->lazy->state[req->rec] = LAZY_ON_DISK;
+	}
+    }
+
+    /* ...and everything else in the batch goes on the LRU list. A record
+       asked for twice is settled the first time round. */
+    for (i = 0; i < count; i++) {
+	struct PDB* pdb = requests[i].pdb;
+	struct PDB_Lazy* lazy = pdb->lazy;
+	unsigned int rec = requests[i].rec;
+
+	if (requests[i].result == 0 && lazy != NULL && rec < lazy->num_records) {
+	    if (lazy->state[rec] == LAZY_BATCHED) {
+		lazy->state[rec] = LAZY_CACHED;
+		LazyPushHead(lazy, rec);
+	    } else if (lazy->state[rec] == LAZY_ON_DISK) {
+		requests[i].result = -1;
+	    }
+	}
+	if (requests[i].result != 0)
+	    result = -1;
+    }
+
+    free(reads);
+    return result;
+}
+
+int PDB_FetchRecords(struct PDB* pdb, const unsigned int* recs, unsigned int count)
+{
+    PDB_FetchRequest* requests;
+    unsigned int i;
+    int result;
+
+    if (recs == NULL)
+	count = pdb->num_records;
+    requests = (PDB_FetchRequest *)Malloc((count > 0 ? count : 1) * sizeof (PDB_FetchRequest));
+    if (requests == NULL)
+	return -1;
+    for (i = 0; i < count; i++) {
+	requests[i].pdb = pdb;
+	requests[i].rec = (recs != NULL ? recs[i] : i);
+    }
+
+    result = PDB_FetchBatch(requests, count);
+    free(requests);
+    return result;
+}
+
+struct PDB_UIDIndex {
+    unsigned int mask;          /* number of slots - 1; a power of two minus one */
+    unsigned int* slots;        /* record number + 1, or 0 for an empty slot */
+};
+
+static unsigned int HashUID(unsigned int unique_id)
+{
+    return (unique_id * 2654435761U) >> 7;
+}
+
+static void DropUIDIndex(struct PDB* pdb)
+{
+    if (pdb->uid_index != NULL) {
+	free(pdb->uid_index->slots);
+	free(pdb->uid_index);
+	pdb->uid_index = NULL;
+    }
+}
+
+/* Builds an open addressing table, at most half full, mapping each
+   unique ID to its first record. */
+static int BuildUIDIndex(struct PDB* pdb)
+{
+    struct PDB_UIDIndex* index;
+    unsigned int size = 16;
+    unsigned int i, slot;
+
+    while (size < pdb->num_records * 2)
+	size *= 2;
+
+    index = (struct PDB_UIDIndex *)Malloc(sizeof (struct PDB_UIDIndex));
+    if (index == NULL)
+	return -1;
+    index->mask = size - 1;
+    index->slots = (unsigned int *)Calloc(size, sizeof (unsigned int));
+    if (index->slots == NULL) {
+	free(index);
+	return -1;
+    }
+
+    for (i = 0; i < pdb->num_records; i++) {
+	unsigned int unique_id = pdb->records[i].unique_id;
+	for (slot = HashUID(unique_id) & index->mask; index->slots[slot] != 0;
+	     slot = (slot + 1) & index->mask) {
+	    if (pdb->records[index->slots[slot] - 1].unique_id == unique_id)
+		break;
+	}
+	if (index->slots[slot] == 0)
+	    index->slots[slot] = i + 1;
+    }
+
+    pdb->uid_index = index;
+    return 0;
+}
+
+int PDB_FindRecordByUID(struct PDB* pdb, unsigned int unique_id)
+{
+    struct PDB_UIDIndex* index;
+    unsigned int slot;
+
+    if (pdb->uid_index == NULL && BuildUIDIndex(pdb) != 0)
+	return -1;
+
+    index = pdb->uid_index;
+    for (slot = HashUID(unique_id) & index->mask; index->slots[slot] != 0;
+	 slot = (slot + 1) & index->mask) {
+	if (pdb->records[index->slots[slot] - 1].unique_id == unique_id)
+	    return index->slots[slot] - 1;
+    }
+    return -1;
+}
+
+int PDB_SetRecordUID(struct PDB* pdb, unsigned int rec, unsigned int unique_id)
+{
+    if (rec >= pdb->num_records || unique_id > 0xFFFFFF)
+	return -1;
+    pdb->records[rec].unique_id = unique_id;
+    DropUIDIndex(pdb);
+    return 0;
+}
+
+/* Resources are indexed by type (packed big endian, so it sorts like the
+   characters), then ID, then record number so the first match wins. */
+struct PDB_ResourceKey {
+    unsigned int type;
+    unsigned int id;
+    unsigned int rec;
+};
+
+struct PDB_ResourceIndex {
+    unsigned int count;
+    struct PDB_ResourceKey* keys;
+};
+
+static unsigned int PackType(const char* type)
+{
+    unsigned char buf[4] = { 0, 0, 0, 0 };
+    unsigned int i;
+
+    for (i = 0; i < 4 && type[i] != '\0'; i++) {
+	buf[i] = type[i];
+    }
+    return GetBE32(buf);
+}
+
+static int CompareResourceKeys(const void* a, const void* b)
+{
+    const struct PDB_ResourceKey* ka = (const struct PDB_ResourceKey *)a;
+    const struct PDB_ResourceKey* kb = (const struct PDB_ResourceKey *)b;
+
+    if (ka->type != kb->type)
+	return (ka->type < kb->type ? -1 : 1);
+    if (ka->id != kb->id)
+	return (ka->id < kb->id ? -1 : 1);
+    if (ka->rec != kb->rec)
+	return (ka->rec < kb->rec ? -1 : 1);
+    return 0;
+}
+
+static void DropResourceIndex(struct PDB* pdb)
+{
+    if (pdb->resource_index != NULL) {
+	free(pdb->resource_index->keys);
+	free(pdb->resource_index);
+	pdb->resource_index = NULL;
+    }
+}
+
+static int BuildResourceIndex(struct PDB* pdb)
+{
+    struct PDB_ResourceIndex* index;
+    unsigned int i;
+
+    index = (struct PDB_ResourceIndex *)Malloc(sizeof (struct PDB_ResourceIndex));
+    if (index == NULL)
+	return -1;
+    index->count = pdb->num_records;
+    index->keys = (struct PDB_ResourceKey *)Malloc((index->count + 1) * sizeof (struct PDB_ResourceKey));
+    if (index->keys == NULL) {
+	free(index);
+	return -1;
+    }
+
+    for (i = 0; i < index->count; i++) {
+	index->keys[i].type = PackType(pdb->records[i].resource_type);
+	index->keys[i].id = pdb->records[i].resource_id;
+	index->keys[i].rec = i;
+    }
+    qsort(index->keys, index->count, sizeof (struct PDB_ResourceKey), CompareResourceKeys);
+
+    pdb->resource_index = index;
+    return 0;
+}
+
+int PDB_FindResource(struct PDB* pdb, const char* type, unsigned int id)
+{
+    struct PDB_ResourceIndex* index;
+    struct PDB_ResourceKey key;
+    unsigned int lo, hi, mid;
+
+    if (!(pdb->attributes & PDB_ATTR_RESOURCE))
+	return -1;
+    if (pdb->resource_index == NULL && BuildResourceIndex(pdb) != 0)
+	return -1;
+
+    /* Find the first key at or after (type, id, 0). */
+    index = pdb->resource_index;
+    key.type = PackType(type);
+    key.id = id;
+    key.rec = 0;
+    lo = 0;
+    hi = index->count;
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (CompareResourceKeys(&index->keys[mid], &key) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    if (lo < index->count && index->keys[lo].type == key.type && index->keys[lo].id == id)
+	return index->keys[lo].rec;
+    return -1;
+}
+
+int PDB_SetResource(struct PDB* pdb, unsigned int rec, const char* type, unsigned int id, const void* data, unsigned int length)
+{
+    char new_type[5];
+
+    if (!(pdb->attributes & PDB_ATTR_RESOURCE) || id > 0xFFFF)
+	return -1;
+    if (PDB_SetRecord(pdb, rec, data, length, 0) != 0)
+	return -1;
+
+    /* type may well be the record's current type. */
+    memset(new_type, 0, sizeof (new_type));
+    strncpy(new_type, type, 4);
+    memcpy(pdb->records[rec].resource_type, new_type, sizeof (new_type));
+    pdb->records[rec].resource_id = id;
+    DropResourceIndex(pdb);
+    return 0;
+}
+
+/* Sorting by key. Every record's key is found once, the (key, record
+   number) pairs are sorted, which keeps records with equal keys in
+   order, and the record list is then rearranged to match. Big lists are
+   split in halves sorted on threads of their own, down to about one
+   piece per processor, and merged back together. */
+
+#define SORT_PARALLEL_MIN 16384
+
+typedef struct SortItem {
+    const void* key;
+    unsigned int key_length;
+    unsigned int rec;
+} SortItem;
+
+typedef struct SortTask {
+    SortItem* items;
+    SortItem* scratch;          /* as big as items, for merging */
+    unsigned int count;
+    int depth;                  /* how many more times to split */
+} SortTask;
+
+/* Bytewise, with a key ordered before any longer key it begins. */
+static int CompareKeys(const void* a, unsigned int a_length, const void* b, unsigned int b_length)
+{
+    int c = 0;
+
+    if (a_length > 0 && b_length > 0)
+	c = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if (c != 0)
+	return c;
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+static int CompareSortItems(const void* a, const void* b)
+{
+    const SortItem* x = (const SortItem *)a;
+    const SortItem* y = (const SortItem *)b;
+    int c = CompareKeys(x->key, x->key_length, y->key, y->key_length);
+
+    if (c != 0)
+	return c;
+    return (x->rec > y->rec) - (x->rec < y->rec);
+}
+
+static void* SortPart(void* arg)
+{
+    SortTask* task = (SortTask *)arg;
+    SortItem* items = task->items;
+    SortTask left, right;
+    pthread_t thread;
+    unsigned int half, i, j, k;
+    int threaded;
+
+    if (task->depth == 0 || task->count < SORT_PARALLEL_MIN) {
+	qsort(items, task->count, sizeof (SortItem), CompareSortItems);
+	return NULL;
+    }
+
+    half = task->count / 2;
+    left.items = items;
+    left.scratch = task->scratch;
+    left.count = half;
+    left.depth = task->depth - 1;
+    right.items = items + half;
+    right.scratch = task->scratch + half;
+    right.count = task->count - half;
+    right.depth = task->depth - 1;
+
+    /* If no thread can be had, both halves are just sorted here. */
+    threaded = (pthread_create(&thread, NULL, SortPart, &left) == 0);
+    if (!threaded)
+	SortPart(&left);
+    SortPart(&right);
+    if (threaded)
+	pthread_join(thread, NULL);
+
+    for (i = 0, j = half, k = 0; k < task->count; k++) {
+	if (j == task->count || (i < half && CompareSortItems(&items[i], &items[j]) < 0))
+	    task->scratch[k] = items[i++];
+	else
+	    task->scratch[k] = items[j++];
+    }
+    memcpy(items, task->scratch, task->count * sizeof (SortItem));
+    return NULL;
+}
+
+int PDB_SortRecords(struct PDB* pdb, PDB_KeyFunc key, void* ctx)
+{
+    unsigned int num_records = pdb->num_records;
+    SortItem* items = NULL;
+    PDB_Record* sorted = NULL;
+    const void* data;
+    SortTask task;
+    long cpus;
+    unsigned int i;
+    int result = -1;
+
+    if (num_records < 2)
+	return 0;
+
+    items = (SortItem *)Malloc(2 * (size_t)num_records * sizeof (SortItem));
+    sorted = (PDB_Record *)Malloc(num_records * sizeof (PDB_Record));
+    if (items == NULL || sorted == NULL)
+	goto done;
+
+    /* Keys point into the records' data, so every record is made
+       resident first; a lazy database is loaded whole. */
+    for (i = 0; i < num_records; i++) {
+	data = PDB_GetRecordData(pdb, i);
+	if (data == NULL && pdb->records[i].length > 0)
+	    goto done;
+	LazyForget(pdb, i);
+	items[i].key = key(data, pdb->records[i].length, &items[i].key_length, ctx);
+	items[i].rec = i;
+    }
+
+    task.items = items;
+    task.scratch = items + num_records;
+    task.count = num_records;
+    task.depth = 0;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while (cpus > 1 && task.depth < 8) {
+	task.depth++;
+	cpus = (cpus + 1) / 2;
+    }
+    SortPart(&task);
+
+    for (i = 0; i < num_records; i++) {
+	sorted[i] = pdb->records[items[i].rec];
+    }
+    memcpy(pdb->records, sorted, num_records * sizeof (PDB_Record));
+
+    /* Record numbers all changed. */
+    DropUIDIndex(pdb);
+    DropResourceIndex(pdb);
+    result = 0;
+
+ done:
+    free(sorted);
+    free(items);
+    return result;
+}
+
+int PDB_FindRecordByKey(struct PDB* pdb, const void* key, unsigned int key_length, PDB_KeyFunc key_func, void* ctx)
+{
+    unsigned int low = 0, high = pdb->num_records;
+    unsigned int mid, length;
+    const void* data;
+    const void* k;
+    int c;
+
+    /* The first record whose key isn't less than the one wanted. */
+    while (low < high) {
+	mid = low + (high - low) / 2;
+	data = PDB_GetRecordData(pdb, mid);
+	if (data == NULL && pdb->records[mid].length > 0)
+	    return -1;
+	k = key_func(data, pdb->records[mid].length, &length, ctx);
+	c = CompareKeys(k, length, key, key_length);
+	if (c < 0)
+	    low = mid + 1;
+	else
+	    high = mid;
+    }
+    if (low == pdb->num_records)
+	return -1;
+
+    data = PDB_GetRecordData(pdb, low);
+    if (data == NULL && pdb->records[low].length > 0)
+	return -1;
+    k = key_func(data, pdb->records[low].length, &length, ctx);
+    if (CompareKeys(k, length, key, key_length) != 0)
+	return -1;
+    return low;
+}
+
+void PDB_Init(struct PDB* pdb, const char* name, unsigned int version, const char* type, const char* creator)
+{
+    memset(pdb, 0, sizeof (struct PDB));
+    strncpy(pdb->name, name, 31);
+    strncpy(pdb->type, type, 4);
+    strncpy(pdb->creator, creator, 4);
+    /* Times are in seconds since January 1904.
+       This probably isn't exactly right, but close enough. */
+    pdb->creation_time = time(NULL) + 2082801600;
+    pdb->modification_time = time(NULL) + 2082801600;
+    pdb->version = version;
+}
+
+void PDB_Free(struct PDB* pdb)
+{
+    PDB_SetAppInfoBlock(pdb, NULL, 0);
+    PDB_SetSortInfoBlock(pdb, NULL, 0);
+    PDB_SetNumRecords(pdb, 0);
+    if (pdb->map_base != NULL)
+	munmap(pdb->map_base, pdb->map_length);
+    free(pdb->arena);
+    DropUIDIndex(pdb);
+    DropResourceIndex(pdb);
+    if (pdb->lazy != NULL) {
+	close(pdb->lazy->fd);
+	free(pdb->lazy->hashes);
+	free(pdb->lazy);
+    }
+    memset(pdb, 0, sizeof (struct PDB));
+}
+
+int PDB_SetAppInfoBlock(struct PDB* pdb, const void* block, unsigned int bytes)
+{
+    void* old_block = pdb->app_info_block;
+    if (block != NULL && bytes > 0) {
+	pdb->app_info_block = Malloc(bytes);	
+	if (pdb->app_info_block == NULL) {
+	    pdb->app_info_block = old_block;
+	    return -1;
+	}
+	memcpy(pdb->app_info_block, block, bytes);
+	pdb->app_info_length = bytes;
+    } else {
+	pdb->app_info_block = NULL;
+	pdb->app_info_length = 0;
+    }
+    FreeData(pdb, old_block);
+    return 0;
+}
+
+int PDB_SetSortInfoBlock(struct PDB* pdb, const void* block, unsigned int bytes)
+{
+    void* old_block = pdb->sort_info_block;
+    if (block != NULL && bytes > 0) {
+	pdb->sort_info_block = Malloc(bytes);
+	if (pdb->sort_info_block == NULL) {
+	    pdb->sort_info_block = old_block;
+	    return -1;
+	}
+	memcpy(pdb->sort_info_block, block, bytes);
+	pdb->sort_info_length = bytes;
+    } else {
+	pdb->sort_info_block = NULL;
+	pdb->sort_info_length = 0;
+    }
+    FreeData(pdb, old_block);
+    return 0;
+}
+
+int PDB_Reserve(struct PDB* pdb, unsigned int capacity)
+{
+    PDB_Record* new_records;
+
+    if (capacity <= pdb->capacity)
+	return 0;
+    new_records = (PDB_Record*)Realloc(pdb->records, capacity * sizeof (struct PDB_Record));
+    if (new_records == NULL)
+	return -1;
+    pdb->records = new_records;
+    pdb->capacity = capacity;
+    return 0;
+}
+
+int PDB_SetNumRecords(struct PDB* pdb, unsigned int num)
+{
+    if (num != pdb->num_records) {
+	DropUIDIndex(pdb);
+	DropResourceIndex(pdb);
+    }
+
+    if (num < pdb->num_records) {
+	unsigned int i;
+	for (i = num; i < pdb->num_records; i++) {
+	    LazyForget(pdb, i);
+	    ReleaseRecord(pdb, &pdb->records[i]);
+	}
+	pdb->num_records = num;
+    } else if (num > pdb->num_records) {
+	unsigned int i;
+	if (num > pdb->capacity) {
+	    /* Growing geometrically keeps adding records one at a time
+	       linear overall, rather than a realloc per record. */
+	    unsigned int capacity = (pdb->capacity < 8 ? 16 : pdb->capacity * 2);
+	    if (capacity < num || capacity < pdb->capacity)
+		capacity = num;
+	    if (PDB_Reserve(pdb, capacity) != 0)
+		return -1;
+	}
+	for (i = pdb->num_records; i < num; i++) {
+	    memset(&pdb->records[i], 0, sizeof (struct PDB_Record));
+	    if (!(pdb->attributes & PDB_ATTR_RESOURCE))
+		pdb->records[i].unique_id = NextUID(pdb);
+	}
+	pdb->num_records = num;
+    }
+
+    /* The array keeps its room for regrowth unless it's emptied, even
+       if it was empty already and only reserved. */
+    if (num == 0) {
+	free(pdb->records);
+	pdb->records = NULL;
+	pdb->capacity = 0;
+    }
+    return 0;
+}
+
+int PDB_AppendRecords(struct PDB* pdb, unsigned int count)
+{
+    unsigned int first = pdb->num_records;
+
+    if (count > INT_MAX - first)
+	return -1;
+    if (PDB_SetNumRecords(pdb, first + count) != 0)
+	return -1;
+    return first;
+}
+
+int PDB_AppendRecord(struct PDB* pdb, const void* data, unsigned int length, unsigned int attr)
+{
+    int rec = PDB_AppendRecords(pdb, 1);
+
+    if (rec < 0)
+	return -1;
+    if (PDB_SetRecord(pdb, rec, data, length, attr) != 0) {
+	PDB_SetNumRecords(pdb, rec);
+	return -1;
+    }
+    return rec;
+}
+
+int PDB_SetRecord(struct PDB* pdb, unsigned int rec, const void *data, unsigned int length, unsigned int attr)
+{
+    PDB_Record* r;
+    void* new_data;
+    if (rec >= pdb->num_records)
+	return -1;
+
+    LazyForget(pdb, rec);
+    r = &pdb->records[rec];
+
+    /* Empty records carry no data, as when they're read from a file;
+       realloc to 0 bytes might free the old data and return NULL. */
+    if (length == 0) {
+	ReleaseRecord(pdb, r);
+	r->attributes = attr;
+	r->length = 0;
+	return 0;
+    }
+
+    /* Data that lives in a file mapping or the read arena, or belongs to
+       someone else, can't be resized in place. */
+    if (r->release != NULL || IsShared(pdb, r->data)) {
+	new_data = Malloc(length);
+	if (new_data == NULL)
+	    return -1;
+	memcpy(new_data, data, length);
+	ReleaseRecord(pdb, r);
+    } else {
+	new_data = Realloc(r->data, length);
+	if (new_data == NULL)
+	    return -1;
+	memcpy(new_data, data, length);
+    }
+
+    r->data = new_data;
+    r->attributes = attr;
+    r->length = length;
+
+    return 0;
+}
+
+int PDB_AdoptRecord(struct PDB* pdb, unsigned int rec, void* data, unsigned int length, unsigned int attr)
+{
+    PDB_Record* r;
+
+    if (rec >= pdb->num_records)
+	return -1;
+
+    LazyForget(pdb, rec);
+    r = &pdb->records[rec];
+    if (r->data != data || r->release != NULL)
+	ReleaseRecord(pdb, r);
+
+    r->data = data;
+    r->attributes = attr;
+    r->length = length;
+    return 0;
+}
+
+/* Stands in for a missing release callback, so borrowed data is never
+   mistaken for the record's own. */
+static void KeepBorrowed(void* data, void* ctx)
+{
+    (void)data;
+    (void)ctx;
+}
+
+int PDB_BorrowRecord(struct PDB* pdb, unsigned int rec, const void* data, unsigned int length, unsigned int attr,
+		     void (*release)(void* data, void* ctx), void* ctx)
+{
+    PDB_Record* r;
+
+    if (rec >= pdb->num_records)
+	return -1;
+
+    LazyForget(pdb, rec);
+    r = &pdb->records[rec];
+    ReleaseRecord(pdb, r);
+
+    r->data = (void *)data;
+    r->attributes = attr;
+    r->length = length;
+    r->release = (release != NULL ? release : KeepBorrowed);
+    r->release_ctx = ctx;
+    return 0;
+}
+
+int PDB_LoadRecordFromIO(struct PDB* pdb, unsigned int rec, const PDB_IO* io, int terminate, unsigned int attr)
+{
+    unsigned char* data;
+    unsigned int length = 0, limit = 0xFFFF;
+    unsigned int allocated;
+    long size, got;
+    int result;
+
+    /* Allocate for what's there if the stream knows, else for the most
+       that will be taken. Either way the buffer becomes the record, so
+       the data is read exactly once and never copied. */
+    size = (io->size != NULL ? io->size(io->ctx) : -1);
+    if (size >= 0 && size < (long)limit)
+	limit = size;
+    allocated = limit + (terminate ? 1 : 0);
+    data = (unsigned char *)Malloc(allocated > 0 ? allocated : 1);
+    if (data == NULL)
+	return -1;
+
+    while (length < limit) {
+	got = io->read(io->ctx, data + length, limit - length);
+	STAT_ADD(read_calls, 1);
+	if (got < 0) {
+	    free(data);
+	    return -1;
+	}
+	if (got == 0)
+	    break;
+	STAT_ADD(bytes_read, got);
+	length += got;
+    }
+
+    if (terminate) {
+	data[length++] = '\0';
+    }
+
+    /* Give back the slack if the stream ended early. */
+    if (length < allocated) {
+	unsigned char* trimmed = (unsigned char *)Realloc(data, length > 0 ? length : 1);
+	if (trimmed != NULL)
+	    data = trimmed;
+    }
+    result = PDB_AdoptRecord(pdb, rec, data, length, attr);
+    if (result != 0)
+	free(data);
+    return result;
+}
+
+/* PDB_IO callbacks over a file descriptor; ctx points at the fd. */
+static long FdRead(void* ctx, void* buf, unsigned long length)
+{
+    ssize_t got;
+
+    do {
+	got = read(*(int *)ctx, buf, length);
+    } while (got < 0 && errno == EINTR);
+    return got;
+}
+
+static long FdSize(void* ctx)
+{
+    struct stat st;
+
+    if (fstat(*(int *)ctx, &st) != 0 || !S_ISREG(st.st_mode))
+	return -1;
+    return st.st_size;
+}
+
+int PDB_LoadRecordFromFile(struct PDB* pdb, unsigned int rec, const char* filename, int terminate, unsigned int attr)
+{
+    PDB_IO io;
+    int fd, result;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+
+    memset(&io, 0, sizeof (io));
+    io.read = FdRead;
+    io.size = FdSize;
+    io.ctx = &fd;
+    result = PDB_LoadRecordFromIO(pdb, rec, &io, terminate, attr);
+
+    close(fd);
+    return result;
+}
+
+/* Fills buf with up to length bytes of a stream, then the terminator if
+   *terminate is still set and there's room. Short only at the end of the
+   stream. Returns the number of bytes in buf, or -1 on error. */
+static long ChunkFill(const PDB_IO* io, unsigned char* buf, unsigned int length, int* terminate)
+{
+    unsigned int have = 0;
+    long got;
+
+    while (have < length) {
+	got = io->read(io->ctx, buf + have, length - have);
+	STAT_ADD(read_calls, 1);
+	if (got < 0)
+	    return -1;
+	if (got == 0)
+	    break;
+	STAT_ADD(bytes_read, got);
+	have += got;
+    }
+    if (have < length && *terminate) {
+	buf[have++] = '\0';
+	*terminate = 0;
+    }
+    return have;
+}
+
+int PDB_AppendChunkedFromIO(struct PDB* pdb, const PDB_IO* io, unsigned int chunk_size, int terminate, unsigned int attr)
+{
+    unsigned int first = pdb->num_records;
+    unsigned char* data;
+    unsigned char* trimmed;
+    long got;
+    int rec;
+
+    if (chunk_size == 0 || chunk_size > 0xFFFF || first >= INT_MAX)
+	return -1;
+
+    /* Each chunk is read into a buffer that then becomes its record. */
+    for (;;) {
+	data = (unsigned char *)Malloc(chunk_size);
+	if (data == NULL)
+	    goto error;
+	got = ChunkFill(io, data, chunk_size, &terminate);
+	if (got < 0 || (got == 0 && pdb->num_records > first)) {
+	    free(data);
+	    if (got < 0)
+		goto error;
+	    break;
+	}
+	if ((unsigned long)got < chunk_size) {
+	    trimmed = (unsigned char *)Realloc(data, got > 0 ? got : 1);
+	    if (trimmed != NULL)
+		data = trimmed;
+	}
+	rec = PDB_AppendRecords(pdb, 1);
+	if (rec < 0 || PDB_AdoptRecord(pdb, rec, data, got, attr) != 0) {
+	    free(data);
+	    goto error;
+	}
+	if ((unsigned long)got < chunk_size)
+	    break;
+    }
+    return first;
+
+ error:
+    PDB_SetNumRecords(pdb, first);
+    return -1;
+}
+
+int PDB_AppendChunkedFromFile(struct PDB* pdb, const char* filename, unsigned int chunk_size, int terminate, unsigned int attr)
+{
+    PDB_IO io;
+    int fd, result;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+
+    memset(&io, 0, sizeof (io));
+    io.read = FdRead;
+    io.size = FdSize;
+    io.ctx = &fd;
+    result = PDB_AppendChunkedFromIO(pdb, &io, chunk_size, terminate, attr);
+
+    close(fd);
+    return result;
+}
+
+int PDB_WriterAddChunked(PDB_Writer* w, const PDB_IO* io, unsigned int chunk_size, int terminate, unsigned int attr)
+{
+    unsigned char* buf;
+    int count = 0;
+    long got;
+
+    if (chunk_size == 0 || chunk_size > 0xFFFF)
+	return -1;
+    buf = (unsigned char *)Malloc(chunk_size);
+    if (buf == NULL)
+	return -1;
+
+    /* One chunk in memory at a time, however long the stream. */
+    for (;;) {
+	got = ChunkFill(io, buf, chunk_size, &terminate);
+	if (got < 0)
+	    count = -1;
+	if (got < 0 || (got == 0 && count > 0))
+	    break;
+	if (PDB_WriterAddRecord(w, buf, got, attr) != 0) {
+	    count = -1;
+	    break;
+	}
+	count++;
+	if ((unsigned long)got < chunk_size)
+	    break;
+    }
+
+    free(buf);
+    return count;
+}
+
+int PDB_WriteRecordsToIO(struct PDB* pdb, unsigned int first, unsigned int count, const PDB_IO* io)
+{
+    const void* data;
+    unsigned long clock;
+    unsigned int i;
+
+    if (pdb->header_only || first > pdb->num_records || count > pdb->num_records - first)
+	return -1;
+
+    clock = StatClock();
+    for (i = first; i < first + count; i++) {
+	if (pdb->records[i].length == 0)
+	    continue;
+	data = PDB_GetRecordData(pdb, i);
+	if (data == NULL || IOWrite(io, data, pdb->records[i].length) != 0)
+	    return -1;
+    }
+    STAT_TIME(body_store_ns, clock);
+    return 0;
+}
+
+/* Record hashing, diffs and patches. The hash is MurmurHash64A, reading
+   the input as little endian words so that the same bytes hash the same
+   on every machine; patches carry a digest of the database they apply
+   to, and may be applied somewhere other than where they were made. */
+
+#define HASH_MUL 0xC6A4A7935BD1E995ULL
+
+static uint64_t GetLE64(const unsigned char* p)
+{
+    uint64_t k;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&k, p, 8);
 #else
-#define SWAP_LE_16(u16) (((u16 & 0xFF00) >> 8) + ((u16 & 0xFF) << 8))
-#define SWAP_BE_16(u16) (u16)
-#define SWAP_LE_32(u32) (((u32 & 0xFF000000) >> 24) + ((u32 & 0x00FF0000) >> 8) + ((u32 & 0x0000FF00) << 8) + ((u32 & 0x000000FF) << 24))
-#define SWAP_BE_32(u32) (u32)
+    unsigned int j;
+
+    k = 0;
+    for (j = 8; j > 0; j--) {
+	k = (k << 8) | p[j - 1];
+    }
 #endif
+    return k;
+}
+
+static uint64_t Hash64(const void* data, unsigned int length, uint64_t seed)
+{
+    const unsigned char* p = (const unsigned char *)data;
+    uint64_t h = seed ^ (length * HASH_MUL);
+    uint64_t k;
+    unsigned int i, j;
+
+    for (i = 0; i + 8 <= length; i += 8) {
+	k = GetLE64(p + i);
+	k *= HASH_MUL;
+	k ^= k >> 47;
+	k *= HASH_MUL;
+	h ^= k;
+	h *= HASH_MUL;
+    }
+    if (length & 7) {
+	k = 0;
+	for (j = length & 7; j > 0; j--) {
+	    k = (k << 8) | p[i + j - 1];
+	}
+	h ^= k;
+	h *= HASH_MUL;
+    }
+
+    h ^= h >> 47;
+    h *= HASH_MUL;
+    h ^= h >> 47;
+    return h;
+}
+
+unsigned long long PDB_HashRecord(const void* data, unsigned int length)
+{
+    return Hash64(data, length, 0);
+}
+
+/* A record's data, fetched first if the database is lazy. Empty records
+   may have no data at all, so those get a dummy pointer rather than
+   NULL, which means the record couldn't be loaded. */
+static const unsigned char* RecordBytes(struct PDB* pdb, unsigned int rec)
+{
+    static const unsigned char empty[1];
+
+    if (pdb->records[rec].length == 0)
+	return empty;
+    return (const unsigned char *)PDB_GetRecordData(pdb, rec);
+}
+
+static int HashAt(struct PDB* pdb, unsigned int rec, uint64_t* hash)
+{
+    struct PDB_Lazy* lazy = pdb->lazy;
+    const unsigned char* data;
+
+    /* A hash from a sidecar index holds until the record is replaced. */
+    if (lazy != NULL && lazy->hashes != NULL && rec < lazy->num_records &&
+	lazy->state[rec] != LAZY_RESIDENT) {
+	*hash = lazy->hashes[rec];
+	return 0;
+    }
+
+    data = RecordBytes(pdb, rec);
+    if (data == NULL)
+	return -1;
+    *hash = Hash64(data, pdb->records[rec].length, 0);
+    return 0;
+}
+
+int PDB_GetRecordHash(struct PDB* pdb, unsigned int rec, unsigned long long* hash)
+{
+    uint64_t h;
+
+    if (rec >= pdb->num_records || HashAt(pdb, rec, &h) != 0)
+	return -1;
+    *hash = h;
+    return 0;
+}
+
+/* Nonzero if two records (of databases of the same kind) differ in
+   anything but their data and attributes. */
+static int IdentityDiffers(const struct PDB* pdb, const PDB_Record* a, const PDB_Record* b)
+{
+    if (pdb->attributes & PDB_ATTR_RESOURCE)
+	return (memcmp(a->resource_type, b->resource_type, 4) != 0 || a->resource_id != b->resource_id);
+    return (a->unique_id != b->unique_id);
+}
+
+static int AddChange(PDB_Change** changes, unsigned int* count, unsigned int* capacity,
+		     unsigned int what, int old_rec, int new_rec)
+{
+    PDB_Change* grown;
+
+    if (*count == *capacity) {
+	*capacity = (*capacity > 0 ? *capacity * 2 : 64);
+	grown = (PDB_Change *)Realloc(*changes, *capacity * sizeof (PDB_Change));
+	if (grown == NULL)
+	    return -1;
+	*changes = grown;
+    }
+    (*changes)[*count].what = what;
+    (*changes)[*count].old_rec = old_rec;
+    (*changes)[*count].new_rec = new_rec;
+    (*count)++;
+    return 0;
+}
+
+int PDB_Diff(struct PDB* old_pdb, struct PDB* new_pdb, int match, PDB_Change** changes, unsigned int* count)
+{
+    unsigned int resource = (old_pdb->attributes & PDB_ATTR_RESOURCE);
+    unsigned int capacity = 0;
+    unsigned char* matched;
+    PDB_Record* a;
+    PDB_Record* b;
+    uint64_t ha, hb;
+    unsigned int what;
+    unsigned int i;
+    int j;
+
+    *changes = NULL;
+    *count = 0;
+    if (old_pdb->header_only || new_pdb->header_only)
+	return -1;
+
+    /* Only databases of the same kind can be matched by identity. */
+    if (resource != (new_pdb->attributes & PDB_ATTR_RESOURCE))
+	match = PDB_MATCH_POSITION;
+
+    matched = (unsigned char *)Calloc(old_pdb->num_records > 0 ? old_pdb->num_records : 1, 1);
+    if (matched == NULL)
+	return -1;
+
+    for (i = 0; i < new_pdb->num_records; i++) {
+	b = &new_pdb->records[i];
+	if (match == PDB_MATCH_POSITION)
+	    j = (i < old_pdb->num_records ? (int)i : -1);
+	else if (resource)
+	    j = PDB_FindResource(old_pdb, b->resource_type, b->resource_id);
+	else
+	    j = PDB_FindRecordByUID(old_pdb, b->unique_id);
+	/* Duplicate IDs match their first partner only. */
+	if (j >= 0 && matched[j])
+	    j = -1;
+
+	if (j < 0) {
+	    if (AddChange(changes, count, &capacity, PDB_DIFF_ADDED, -1, i) != 0)
+		goto error;
+	    continue;
+	}
+
+	matched[j] = 1;
+	a = &old_pdb->records[j];
+	what = 0;
+	if (a->length != b->length) {
+	    what |= PDB_DIFF_DATA;
+	} else {
+	    if (HashAt(old_pdb, j, &ha) != 0 || HashAt(new_pdb, i, &hb) != 0)
+		goto error;
+	    if (ha != hb)
+		what |= PDB_DIFF_DATA;
+	}
+	if (!resource && a->attributes != b->attributes)
+	    what |= PDB_DIFF_ATTRIBUTES;
+	if (resource == (new_pdb->attributes & PDB_ATTR_RESOURCE) && IdentityDiffers(old_pdb, a, b))
+	    what |= PDB_DIFF_ID;
+
+	if (what != 0 && AddChange(changes, count, &capacity, what, j, i) != 0)
+	    goto error;
+    }
+
+    for (i = 0; i < old_pdb->num_records; i++) {
+	if (!matched[i] && AddChange(changes, count, &capacity, PDB_DIFF_REMOVED, i, -1) != 0)
+	    goto error;
+    }
+
+    free(matched);
+    return 0;
+
+ error:
+    free(matched);
+    free(*changes);
+    *changes = NULL;
+    *count = 0;
+    return -1;
+}
+
+/* Patches are, with all numbers big endian:
+     "PDBp"
+     78 bytes       the new database's header, as PackHeader packs it
+     4 bytes        number of records in the old database
+     8 bytes        digest of the old database (see PatchDigest)
+     4 bytes        AppInfo length, or 0xFFFFFFFF to keep the old block
+     4 bytes        SortInfo length, likewise
+     the AppInfo block itself, then the SortInfo block
+   then a run of ops, building the new records in order:
+     'c' first count     copies old records first to first+count-1 as is
+     'e' entry           an old record's data, under a new list entry
+     'd' entry data      new data
+   An entry is a record (or resource) list entry as PackEntry packs it,
+   whose offset field holds the old record number for 'e' and the data
+   length for 'd'. Copies are found by content, so records that only
+   moved cost nine bytes per run. */
+
+#define PATCH_MAGIC      "PDBp"
+#define PATCH_FIXED_SIZE (4 + PDB_HEADER_SIZE + 4 + 8 + 4 + 4)
+#define PATCH_KEEP_BLOCK 0xFFFFFFFF
+
+typedef struct PatchBuf {
+    unsigned char* data;
+    unsigned int length;
+    unsigned int capacity;
+} PatchBuf;
+
+/* Makes room for length more bytes and returns where they go. */
+static unsigned char* PatchGrow(PatchBuf* buf, unsigned int length)
+{
+    unsigned int capacity = buf->capacity;
+    unsigned char* grown;
+
+    if (length > 0xFFFFFFFF - buf->length)
+	return NULL;
+    if (buf->length + length > capacity) {
+	while (buf->length + length > capacity) {
+	    capacity = (capacity < 0x80000000 ? capacity * 2 : 0xFFFFFFFF);
+	}
+	grown = (unsigned char *)Realloc(buf->data, capacity);
+	if (grown == NULL)
+	    return NULL;
+	buf->data = grown;
+	buf->capacity = capacity;
+    }
+    buf->length += length;
+    return buf->data + buf->length - length;
+}
+
+/* Appends block, unless it's the same as old_block, and sets the length
+   field at offset field to suit. */
+static int PatchBlock(PatchBuf* buf, unsigned int field, const void* old_block, unsigned int old_length,
+		      const void* block, unsigned int length)
+{
+    unsigned char* p;
+
+    if (length == old_length && (length == 0 || !memcmp(block, old_block, length))) {
+	PutBE32(buf->data + field, PATCH_KEEP_BLOCK);
+	return 0;
+    }
+    PutBE32(buf->data + field, length);
+    p = PatchGrow(buf, length);
+    if (p == NULL)
+	return -1;
+    if (length > 0)
+	memcpy(p, block, length);
+    return 0;
+}
+
+/* Hashes the record list and all the data of a database, plus its AppInfo
+   and SortInfo blocks. Also fills in the hash of each record, if hashes
+   isn't NULL. */
+static int PatchDigest(struct PDB* pdb, uint64_t* digest, uint64_t* hashes)
+{
+    unsigned char entry[PDB_RES_ENTRY_SIZE];
+    uint64_t h, rh;
+    unsigned int i;
+
+    h = Hash64(pdb->app_info_block, pdb->app_info_length, pdb->num_records);
+    h = Hash64(pdb->sort_info_block, pdb->sort_info_length, h);
+    for (i = 0; i < pdb->num_records; i++) {
+	if (HashAt(pdb, i, &rh) != 0)
+	    return -1;
+	if (hashes != NULL)
+	    hashes[i] = rh;
+	PackEntry(pdb, entry, pdb->records[i].length, &pdb->records[i]);
+	h = Hash64(entry, EntrySize(pdb->attributes), h ^ rh);
+    }
+    *digest = h;
+    return 0;
+}
+
+/* Looks for an old record with the same data as new record rec, trying
+   the one after the last copy first so runs of copies stay runs.
+   Hash matches are confirmed byte for byte. Returns -1 if there is none. */
+static int FindCopy(struct PDB* old_pdb, const uint64_t* hashes, const unsigned int* slots, unsigned int mask,
+		    int hint, struct PDB* new_pdb, unsigned int rec, uint64_t hash)
+{
+    unsigned int length = new_pdb->records[rec].length;
+    const unsigned char* a;
+    const unsigned char* b;
+    unsigned int slot;
+    int i;
+
+    i = hint;
+    if (i < 0 || (unsigned int)i >= old_pdb->num_records || hashes[i] != hash)
+	i = -1;
+    for (slot = (unsigned int)hash & mask; ; slot = (slot + 1) & mask) {
+	if (i >= 0 && old_pdb->records[i].length == length) {
+	    a = RecordBytes(old_pdb, i);
+	    b = RecordBytes(new_pdb, rec);
+	    if (a == NULL || b == NULL)
+		return -1;
+	    if (memcmp(a, b, length) == 0)
+		return i;
+	}
+	if (slots[slot] == 0)
+	    return -1;
+	i = slots[slot] - 1;
+	if (hashes[i] != hash)
+	    i = -1;
+    }
+}
+
+int PDB_MakePatch(struct PDB* old_pdb, struct PDB* new_pdb, void** patch, unsigned int* length)
+{
+    unsigned int entry_size = EntrySize(new_pdb->attributes);
+    int same_kind = ((old_pdb->attributes & PDB_ATTR_RESOURCE) == (new_pdb->attributes & PDB_ATTR_RESOURCE));
+    uint64_t* hashes = NULL;
+    unsigned int* slots = NULL;
+    unsigned int size = 16, slot;
+    unsigned int run = 0;       /* where the count of the last 'c' op is, while it can grow */
+    unsigned char* p;
+    PatchBuf buf;
+    uint64_t digest, hash;
+    unsigned int i;
+    int last = -1, from;
+
+    *patch = NULL;
+    *length = 0;
+    memset(&buf, 0, sizeof (buf));
+
+    if (new_pdb->num_records > 0xFFFF || old_pdb->header_only || new_pdb->header_only)
+	return -1;
+
+    hashes = (uint64_t *)Malloc((old_pdb->num_records > 0 ? old_pdb->num_records : 1) * sizeof (uint64_t));
+    if (hashes == NULL || PatchDigest(old_pdb, &digest, hashes) != 0)
+	goto error;
+
+    /* Old records by hash, open addressed and at most half full, as
+       for the unique ID index. */
+    while (size < old_pdb->num_records * 2)
+	size *= 2;
+    slots = (unsigned int *)Calloc(size, sizeof (unsigned int));
+    if (slots == NULL)
+	goto error;
+    for (i = 0; i < old_pdb->num_records; i++) {
+	for (slot = (unsigned int)hashes[i] & (size - 1); slots[slot] != 0; slot = (slot + 1) & (size - 1))
+	    ;
+	slots[slot] = i + 1;
+    }
+
+    buf.capacity = 4096;
+    buf.data = (unsigned char *)Malloc(buf.capacity);
+    if (buf.data == NULL)
+	goto error;
+    p = PatchGrow(&buf, PATCH_FIXED_SIZE);
+    memcpy(p, PATCH_MAGIC, 4);
+    PackHeader(new_pdb, p + 4, 0);
+    PutBE32(p + 4 + PDB_HEADER_SIZE, old_pdb->num_records);
+    PutBE32(p + 8 + PDB_HEADER_SIZE, (unsigned int)(digest >> 32));
+    PutBE32(p + 12 + PDB_HEADER_SIZE, (unsigned int)digest);
+    if (PatchBlock(&buf, 16 + PDB_HEADER_SIZE, old_pdb->app_info_block, old_pdb->app_info_length,
+		   new_pdb->app_info_block, new_pdb->app_info_length) != 0 ||
+	PatchBlock(&buf, 20 + PDB_HEADER_SIZE, old_pdb->sort_info_block, old_pdb->sort_info_length,
+		   new_pdb->sort_info_block, new_pdb->sort_info_length) != 0)
+	goto error;
+
+    for (i = 0; i < new_pdb->num_records; i++) {
+	PDB_Record* r = &new_pdb->records[i];
+
+	from = -1;
+	if (same_kind) {
+	    if (HashAt(new_pdb, i, &hash) != 0)
+		goto error;
+	    from = FindCopy(old_pdb, hashes, slots, size - 1, last + 1, new_pdb, i, hash);
+	}
+
+	if (from >= 0 && !IdentityDiffers(old_pdb, &old_pdb->records[from], r) &&
+	    old_pdb->records[from].attributes == r->attributes) {
+	    if (run != 0 && from == last + 1) {
+		PutBE32(buf.data + run, GetBE32(buf.data + run) + 1);
+	    } else {
+		p = PatchGrow(&buf, 9);
+		if (p == NULL)
+		    goto error;
+		p[0] = 'c';
+		PutBE32(p + 1, from);
+		PutBE32(p + 5, 1);
+		run = p + 5 - buf.data;
+	    }
+	} else if (from >= 0) {
+	    p = PatchGrow(&buf, 1 + entry_size);
+	    if (p == NULL)
+		goto error;
+	    p[0] = 'e';
+	    PackEntry(new_pdb, p + 1, from, r);
+	    run = 0;
+	} else {
+	    const unsigned char* data = RecordBytes(new_pdb, i);
+	    if (data == NULL)
+		goto error;
+	    p = PatchGrow(&buf, 1 + entry_size + r->length);
+	    if (p == NULL)
+		goto error;
+	    p[0] = 'd';
+	    PackEntry(new_pdb, p + 1, r->length, r);
+	    memcpy(p + 1 + entry_size, data, r->length);
+	    run = 0;
+	}
+	last = from;
+    }
+
+    free(slots);
+    free(hashes);
+    *patch = buf.data;
+    *length = buf.length;
+    return 0;
+
+ error:
+    free(buf.data);
+    free(slots);
+    free(hashes);
+    return -1;
+}
+
+/* Takes the block whose length field is at field, either from the patch
+   at *p or, if the patch keeps it, from the old database. */
+static int PatchTakeBlock(const unsigned char* field, const unsigned char** p, const unsigned char* end,
+			  const void* old_block, unsigned int old_length,
+			  const void** block, unsigned int* length)
+{
+    *length = GetBE32(field);
+    if (*length == PATCH_KEEP_BLOCK) {
+	*block = old_block;
+	*length = old_length;
+	return 0;
+    }
+    if (*length > (unsigned int)(end - *p))
+	return -1;
+    *block = *p;
+    *p += *length;
+    return 0;
+}
+
+int PDB_ApplyPatch(struct PDB* old_pdb, const void* patch, unsigned int length, struct PDB* pdb)
+{
+    const unsigned char* p = (const unsigned char *)patch;
+    const unsigned char* end = p + length;
+    const unsigned char* header = p + 4;
+    const unsigned char* ops;
+    const unsigned char* src;
+    const void* app_info;
+    const void* sort_info;
+    unsigned int app_info_offset, app_info_length;
+    unsigned int sort_info_offset, sort_info_length;
+    unsigned int num_records, entry_size;
+    unsigned int field, count;
+    unsigned int i, k, pos;
+    unsigned long total;
+    unsigned char op;
+    uint64_t digest;
+    PDB_Record scratch;
+    PDB_Record* r;
+
+    memset(pdb, 0, sizeof (struct PDB));
+    if (old_pdb->header_only || length < PATCH_FIXED_SIZE || memcmp(p, PATCH_MAGIC, 4) != 0)
+	return -1;
+    num_records = UnpackHeader(pdb, header, &app_info_offset, &sort_info_offset);
+    entry_size = EntrySize(pdb->attributes);
+
+    /* Only ever applied to the database it was made from. */
+    if (GetBE32(header + PDB_HEADER_SIZE) != old_pdb->num_records ||
+	PatchDigest(old_pdb, &digest, NULL) != 0 ||
+	digest != (((uint64_t)GetBE32(header + PDB_HEADER_SIZE + 4) << 32) |
+		   GetBE32(header + PDB_HEADER_SIZE + 8)))
+	return -1;
 
+    p += PATCH_FIXED_SIZE;
+    if (PatchTakeBlock(header + PDB_HEADER_SIZE + 12, &p, end, old_pdb->app_info_block,
+		       old_pdb->app_info_length, &app_info, &app_info_length) != 0 ||
+	PatchTakeBlock(header + PDB_HEADER_SIZE + 16, &p, end, old_pdb->sort_info_block,
+		       old_pdb->sort_info_length, &sort_info, &sort_info_length) != 0)
+	return -1;
 
-int PDB_WriteFile(struct PDB* pdb, const char* filename)
-{
-    FILE* f;
-    uint32_t val32;
-    uint16_t val16;
-    unsigned int data_start, cur_start;
-    unsigned int i;
+    /* Check every op and add up the new data before building anything. */
+    ops = p;
+    total = (unsigned long)app_info_length + sort_info_length;
+    memset(&scratch, 0, sizeof (scratch));
+    for (i = 0; i < num_records; ) {
+	if (p == end)
+	    return -1;
+	op = *p;
+	if (op == 'c') {
+	    if (end - p < 9)
+		return -1;
+	    field = GetBE32(p + 1);
+	    count = GetBE32(p + 5);
+	    if (count == 0 || count > num_records - i ||
+		field > old_pdb->num_records || count > old_pdb->num_records - field)
+		return -1;
+	    for (k = field; k < field + count; k++) {
+		total += old_pdb->records[k].length;
+	    }
+	    i += count;
+	    p += 9;
+	} else if (op == 'e' || op == 'd') {
+	    if ((unsigned int)(end - p) < 1 + entry_size)
+		return -1;
+	    field = UnpackEntry(pdb, p + 1, &scratch);
+	    p += 1 + entry_size;
+	    if (op == 'e') {
+		if (field >= old_pdb->num_records)
+		    return -1;
+		total += old_pdb->records[field].length;
+	    } else {
+		if (field > (unsigned int)(end - p))
+		    return -1;
+		total += field;
+		p += field;
+	    }
+	    i++;
+	} else {
+	    return -1;
+	}
+	if (total > 0xFFFFFFFF)
+	    return -1;
+    }
+    if (p != end)
+	return -1;
 
-    f = fopen(filename, "wb");
-    if (f == NULL)
+    /* Then everything goes into one arena, as PDB_ReadFile would have it. */
+    if (PDB_SetNumRecords(pdb, num_records) != 0)
 	return -1;
+    pdb->unique_id_seed = GetBE32(header + 68);
+    pdb->arena = Malloc(total > 0 ? total : 1);
+    if (pdb->arena == NULL)
+	goto error;
+    pdb->arena_length = total;
+    if (app_info_length > 0) {
+	memcpy(pdb->arena, app_info, app_info_length);
+	pdb->app_info_block = pdb->arena;
+	pdb->app_info_length = app_info_length;
+    }
+    if (sort_info_length > 0) {
+	memcpy((unsigned char *)pdb->arena + app_info_length, sort_info, sort_info_length);
+	pdb->sort_info_block = (unsigned char *)pdb->arena + app_info_length;
+	pdb->sort_info_length = sort_info_length;
+    }
+
+    pos = app_info_length + sort_info_length;
+    for (i = 0, p = ops; i < num_records; ) {
+	op = *p;
+	if (op == 'c') {
+	    field = GetBE32(p + 1);
+	    count = GetBE32(p + 5);
+	    p += 9;
+	} else {
+	    field = UnpackEntry(pdb, p + 1, &pdb->records[i]);
+	    count = 1;
+	    p += 1 + entry_size;
+	}
 
-    /* Write the header. */
+	for (k = 0; k < count; k++, i++) {
+	    r = &pdb->records[i];
+	    if (op == 'd') {
+		src = p;
+		r->length = field;
+		p += field;
+	    } else {
+		PDB_Record* from = &old_pdb->records[field + k];
+		src = RecordBytes(old_pdb, field + k);
+		if (src == NULL)
+		    goto error;
+		r->length = from->length;
+		if (op == 'c') {
+		    r->attributes = from->attributes;
+		    r->unique_id = from->unique_id;
+		    memcpy(r->resource_type, from->resource_type, sizeof (r->resource_type));
+		    r->resource_id = from->resource_id;
+		}
+	    }
+	    memcpy((unsigned char *)pdb->arena + pos, src, r->length);
+	    r->data = (unsigned char *)pdb->arena + pos;
+	    pos += r->length;
+	}
+    }
+    return 0;
 
-    /* name: 32 bytes */
-    fwrite(pdb->name, 32, 1, f);
+ error:
+    PDB_Free(pdb);
+    return -1;
+}
 
-    /* attributes: 16-bit big endian */
-    val16 = pdb->attributes; val16 = SWAP_BE_16(val16);
-    fwrite(&val16, 2, 1, f);
+/* Content-addressed record store. Record bodies and AppInfo blocks go
+   into an append-only pack file, each distinct body once, and are found
+   again through a hash index kept in a second append-only file, which is
+   read whole into memory on open. A database put into the store comes
+   back as a manifest: its header and record list, with each body
+   replaced by where it lies in the pack. Keeping manifests is up to the
+   caller. All numbers big endian:
+     pack      "PDBs", then bodies back to back
+     index     "PDBi", then per body: hash (8), pack offset (8), length (4)
+     manifest  "PDBm", the 78-byte header as PackHeader packs it, the
+               AppInfo block's pack offset (8) and length (4), the
+               SortInfo block's likewise, then per
+               record its list entry as PackEntry packs it, with the
+               length in the offset field, and its pack offset (8) */
 
-    /* version: 16-bit big endian */
-    val16 = pdb->version; val16 = SWAP_BE_16(val16);
-    fwrite(&val16, 2, 1, f);
+#define STORE_PACK_MAGIC      "PDBs"
+#define STORE_INDEX_MAGIC     "PDBi"
+#define STORE_MANIFEST_MAGIC  "PDBm"
+#define STORE_INDEX_ENTRY     20
+#define STORE_MANIFEST_FIXED  (4 + PDB_HEADER_SIZE + 12 + 12)
 
-    /* creation date: 32-bit big endian */
-    val32 = pdb->creation_time; val32 = SWAP_BE_32(val32);
-    fwrite(&val32, 4, 1, f);
+typedef struct StoreBody {
+    uint64_t hash;
+    uint64_t offset;
+    unsigned int length;
+} StoreBody;
 
-    /* modification date: 32-bit big endian */
-    val32 = pdb->modification_time; val32 = SWAP_BE_32(val32);
-    fwrite(&val32, 4, 1, f);
+/* A read-only mapping of the pack, as far as length. The store holds a
+   reference to its newest mapping, and every record PDB_StoreGet lends
+   out of one holds another; whoever drops the last reference unmaps it.
+   So mappings the pack has outgrown go as soon as nothing uses them, and
+   databases may outlive the store. References are dropped atomically,
+   as databases may be freed on other threads. */
+typedef struct StoreMap {
+    unsigned char* base;
+    uint64_t length;
+    unsigned int refs;
+} StoreMap;
 
-    /* backup date: 32-bit big endian */
-    val32 = pdb->backup_time; val32 = SWAP_BE_32(val32);
-    fwrite(&val32, 4, 1, f);
-    
-    /* modification number: 32-bit big endian, always set to zero */
-    val32 = 0;
-    fwrite(&val32, 4, 1, f);
+struct PDB_Store {
+    int pack_fd;
+    int index_fd;
+    uint64_t pack_length;
+    uint64_t index_length;
+    StoreBody* bodies;
+    unsigned int num_bodies;
+    unsigned int capacity;
+    unsigned int* slots;        /* body number + 1, or 0 for an empty slot */
+    unsigned int mask;
+    StoreMap* map;              /* the newest mapping of the pack, or NULL */
+};
 
-    /* appinfo area: 32-bit big endian location
-       the appinfo area is always the first item of data, if it exists */
-    data_start = 78 + pdb->num_records * 8;
-    val32 = data_start; val32 = SWAP_BE_32(val32);
-    fwrite(&val32, 4, 1, f);
+static uint64_t GetBE64(const unsigned char* p)
+{
+    return ((uint64_t)GetBE32(p) << 32) | GetBE32(p + 4);
+}
 
-    /* sortinfo area: 32-bit big endian location
-       we don't use this */
-    val32 = 0;
-    fwrite(&val32, 4, 1, f);    
- 
-    /* database type: 4 bytes, not terminated */
-    fwrite(pdb->type, 4, 1, f);
-
-    /* creator ID: 4 bytes, not terminated */
-    fwrite(pdb->creator, 4, 1, f);    
-    
-    /* unique ID seed: 32-bit big endian
-       we don't use this */
-    val32 = 0;
-    fwrite(&val32, 4, 1, f);
-
-    /* next record list ID: 32-bit big endian
-       only for the in memory representation */
-    val32 = 0;
-    fwrite(&val32, 4, 1, f);
-
-    /* number of records: 16-bit big endian */
-    val16 = pdb->num_records; val16 = SWAP_BE_16(val16);
-    fwrite(&val16, 2, 1, f);
-
-    /* Write the record headers. */
-    cur_start = data_start + pdb->app_info_length;
-    for (i = 0; i < pdb->num_records; i++) {
-	uint8_t attr;
+static void PutBE64(unsigned char* p, uint64_t val)
+{
+    PutBE32(p, (unsigned int)(val >> 32));
+    PutBE32(p + 4, (unsigned int)val);
+}
 
-	/* record data offset: 32-bit big endian */
-	val32 = cur_start; val32 = SWAP_BE_32(val32);
-	fwrite(&val32, 4, 1, f);
+/* Rebuilds the hash table over every body with size slots. */
+static int StoreRehash(PDB_Store* store, unsigned int size)
+{
+    unsigned int* slots;
+    unsigned int i, slot;
 
-	/* attributes: 1 byte */
-	attr = pdb->records[i].attributes;
-	fwrite(&attr, 1, 1, f);
+    slots = (unsigned int *)Calloc(size, sizeof (unsigned int));
+    if (slots == NULL)
+	return -1;
+    for (i = 0; i < store->num_bodies; i++) {
+	for (slot = (unsigned int)store->bodies[i].hash & (size - 1); slots[slot] != 0;
+	     slot = (slot + 1) & (size - 1))
+	    ;
+	slots[slot] = i + 1;
+    }
+    free(store->slots);
+    store->slots = slots;
+    store->mask = size - 1;
+    return 0;
+}
 
-	/* unique ID: 3 bytes, set to zero */
-	val32 = 0;
-	fwrite(&val32, 3, 1, f);
+/* Adds a body to the in-memory index, keeping the table at most half full. */
+static int StoreInsert(PDB_Store* store, uint64_t hash, uint64_t offset, unsigned int length)
+{
+    StoreBody* grown;
 
-	cur_start += pdb->records[i].length;
+    if (store->num_bodies == store->capacity) {
+	if (store->capacity > 0x3FFFFFFF)
+	    return -1;
+	grown = (StoreBody *)Realloc(store->bodies, store->capacity * 2 * sizeof (StoreBody));
+	if (grown == NULL)
+	    return -1;
+	store->bodies = grown;
+	store->capacity *= 2;
     }
+    store->bodies[store->num_bodies].hash = hash;
+    store->bodies[store->num_bodies].offset = offset;
+    store->bodies[store->num_bodies].length = length;
+    store->num_bodies++;
 
-    /* Write the data. */
-    if (pdb->app_info_length != 0) {
-	fwrite(pdb->app_info_block, pdb->app_info_length, 1, f);
+    if (store->num_bodies * 2 > store->mask + 1)
+	return StoreRehash(store, (store->mask + 1) * 2);
+    {
+	unsigned int slot;
+	for (slot = (unsigned int)hash & store->mask; store->slots[slot] != 0;
+	     slot = (slot + 1) & store->mask)
+	    ;
+	store->slots[slot] = store->num_bodies;
     }
+    return 0;
+}
 
-    for (i = 0; i < pdb->num_records; i++) {
-	fwrite(pdb->records[i].data, pdb->records[i].length, 1, f);
+#define STORE_COMPARE_CHUNK 4096
+
+static void StoreUnref(StoreMap* map)
+{
+    if (map != NULL && __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+	munmap(map->base, map->length);
+	free(map);
     }
+}
 
-    fclose(f);
+/* The release callback of records lent out of a mapping. */
+static void StoreRelease(void* data, void* ctx)
+{
+    (void)data;
+    StoreUnref((StoreMap *)ctx);
+}
+
+/* Makes sure the newest mapping covers the whole pack, mapping it again
+   if it has grown since. */
+static int StoreMapPack(PDB_Store* store)
+{
+    StoreMap* map;
+    void* base;
+
+    if (store->map != NULL && store->map->length == store->pack_length)
+	return 0;
+    if ((size_t)store->pack_length != store->pack_length)
+	return -1;
+    map = (StoreMap *)Malloc(sizeof (StoreMap));
+    if (map == NULL)
+	return -1;
+    base = mmap(NULL, store->pack_length, PROT_READ, MAP_SHARED, store->pack_fd, 0);
+    if (base == MAP_FAILED) {
+	free(map);
+	return -1;
+    }
+    map->base = (unsigned char *)base;
+    map->length = store->pack_length;
+    map->refs = 1;
+    StoreUnref(store->map);
+    store->map = map;
     return 0;
 }
 
-int PDB_ReadFile(struct PDB* pdb, const char* filename)
+/* Points at length bytes of the newest mapping. Returns NULL if the
+   range is beyond its end. */
+static const unsigned char* StoreBytes(PDB_Store* store, uint64_t offset, unsigned int length)
 {
-    FILE* f;
-    uint32_t val32;
-    uint16_t val16;
-    unsigned int i;
-    unsigned int app_info_offset;
-    unsigned int pos;
-    unsigned int num_records;
-    unsigned int* record_offsets = NULL;
+    if (store->map == NULL || offset > store->map->length || length > store->map->length - offset)
+	return NULL;
+    return store->map->base + offset;
+}
+
+/* Compares data with length bytes of the pack at offset: in place if the
+   newest mapping covers them, else read a piece at a time, so putting
+   never maps the pack. Returns 1 if they're the same, 0 if not, and -1
+   if the pack can't be read. */
+static int StoreCompare(PDB_Store* store, uint64_t offset, const void* data, unsigned int length)
+{
+    unsigned char buf[STORE_COMPARE_CHUNK];
+    const unsigned char* p = (const unsigned char *)data;
+    const unsigned char* bytes;
+    unsigned int n;
 
-    f = fopen(filename, "rb");
-    if (f == NULL)
+    bytes = StoreBytes(store, offset, length);
+    if (bytes != NULL)
+	return (memcmp(bytes, data, length) == 0);
+
+    while (length > 0) {
+	n = (length < sizeof (buf) ? length : sizeof (buf));
+	if (ReadAt(store->pack_fd, buf, n, offset) != 0)
+	    return -1;
+	if (memcmp(buf, p, n) != 0)
+	    return 0;
+	p += n;
+	offset += n;
+	length -= n;
+    }
+    return 1;
+}
+
+/* Finds a body, or appends it to the pack and queues its index entry in
+   pending. Sets *offset to where it lies in the pack. */
+static int StoreAdd(PDB_Store* store, const void* data, unsigned int length, uint64_t* offset, PatchBuf* pending)
+{
+    uint64_t hash = Hash64(data, length, 0);
+    unsigned char* entry;
+    StoreBody* body;
+    unsigned int slot;
+    int same;
+
+    for (slot = (unsigned int)hash & store->mask; store->slots[slot] != 0; slot = (slot + 1) & store->mask) {
+	body = &store->bodies[store->slots[slot] - 1];
+	if (body->hash != hash || body->length != length)
+	    continue;
+	/* Hashes are only a hint; the bytes have to match. */
+	same = StoreCompare(store, body->offset, data, length);
+	if (same < 0)
+	    return -1;
+	if (same) {
+	    *offset = body->offset;
+	    return 0;
+	}
+    }
+
+    entry = PatchGrow(pending, STORE_INDEX_ENTRY);
+    if (entry == NULL || WriteAt(store->pack_fd, data, length, store->pack_length) != 0)
 	return -1;
+    *offset = store->pack_length;
+    store->pack_length += length;
+    PutBE64(entry, hash);
+    PutBE64(entry + 8, *offset);
+    PutBE32(entry + 16, length);
+    return StoreInsert(store, hash, *offset, length);
+}
 
-    memset(pdb, 0, sizeof (struct PDB));
+PDB_Store* PDB_StoreOpen(const char* pack_filename, const char* index_filename)
+{
+    PDB_Store* store;
+    unsigned char* index = NULL;
+    unsigned char magic[4];
+    struct stat st;
+    uint64_t offset;
+    unsigned int length;
+    unsigned int i, count;
 
-    /* database name */
-    fread(pdb->name, 32, 1, f);
-    pdb->name[31] = '\0';         /* don't trust that there's already one there */
-    
-    /* attributes */
-    fread(&val16, 2, 1, f);
-    pdb->attributes = SWAP_BE_16(val16);
-
-    /* version */
-    fread(&val16, 2, 1, f);
-    pdb->version = SWAP_BE_16(val16);
-    
-    /* creation date */
-    fread(&val32, 4, 1, f);
-    pdb->creation_time = SWAP_BE_32(val32);
-    
-    /* modification date */
-    fread(&val32, 4, 1, f);
-    pdb->modification_time = SWAP_BE_32(val32);
-
-    /* last backup date */
-    fread(&val32, 4, 1, f);
-    pdb->backup_time = SWAP_BE_32(val32);
-
-    /* modification number; don't care */
-    fread(&val32, 4, 1, f);
-
-    /* appinfo offset */
-    fread(&val32, 4, 1, f);
-    app_info_offset = SWAP_BE_32(val32);
-
-    /* sortinfo offset; don't care */
-    fread(&val32, 4, 1, f);
-    
-    /* type and creator */
-    fread(pdb->type, 4, 1, f);
-    fread(pdb->creator, 4, 1, f);
-
-    /* unique ID; don't care */
-    fread(&val32, 4, 1, f);
-
-    /* next record list ID; don't care */
-    fread(&val32, 4, 1, f);
-
-    /* number of records */
-    fread(&val16, 2, 1, f);
-    num_records = SWAP_BE_16(val16);
-
-    /* Allocate the record list. */
-    if (PDB_SetNumRecords(pdb, num_records) != 0)
+    store = (PDB_Store *)Calloc(1, sizeof (PDB_Store));
+    if (store == NULL)
+	return NULL;
+    store->pack_fd = -1;
+    store->index_fd = -1;
+    store->capacity = 1024;
+    store->bodies = (StoreBody *)Malloc(store->capacity * sizeof (StoreBody));
+    if (store->bodies == NULL || StoreRehash(store, 2048) != 0)
+	goto error;
+
+    store->pack_fd = open(pack_filename, O_RDWR | O_CREAT, 0644);
+    if (store->pack_fd < 0)
 	goto error;
-    
-    /* Read in the record headers. */
-    record_offsets = (unsigned int *)malloc((num_records + 1) * sizeof (unsigned int));
-    if (record_offsets == NULL)
+    store->index_fd = open(index_filename, O_RDWR | O_CREAT, 0644);
+    if (store->index_fd < 0)
 	goto error;
 
-    /* Figure out the length of the file. */
-    pos = ftell(f);
-    fseek(f, 0, SEEK_END);    
-    record_offsets[num_records] = ftell(f);
-    fseek(f, pos, SEEK_SET);
+    if (fstat(store->pack_fd, &st) != 0)
+	goto error;
+    if (st.st_size == 0) {
+	if (WriteAt(store->pack_fd, STORE_PACK_MAGIC, 4, 0) != 0)
+	    goto error;
+	st.st_size = 4;
+    } else if (ReadAt(store->pack_fd, magic, 4, 0) != 0 || memcmp(magic, STORE_PACK_MAGIC, 4) != 0) {
+	goto error;
+    }
+    store->pack_length = st.st_size;
 
-    /* Read record headers. */
-    for (i = 0; i < num_records; i++) {
-	uint8_t attr;
+    if (fstat(store->index_fd, &st) != 0)
+	goto error;
+    if (st.st_size == 0) {
+	if (WriteAt(store->index_fd, STORE_INDEX_MAGIC, 4, 0) != 0)
+	    goto error;
+	st.st_size = 4;
+    }
+    if (st.st_size < 4 || (uint64_t)st.st_size > 0xFFFFFFFF)
+	goto error;
+    index = (unsigned char *)Malloc(st.st_size);
+    if (index == NULL || ReadAt(store->index_fd, index, st.st_size, 0) != 0 ||
+	memcmp(index, STORE_INDEX_MAGIC, 4) != 0)
+	goto error;
+
+    /* Everything up to the first entry that is torn, or refers past the
+       end of the pack, counts; the rest is cut off so appends line up. */
+    count = (st.st_size - 4) / STORE_INDEX_ENTRY;
+    for (i = 0; i < count; i++) {
+	const unsigned char* entry = index + 4 + i * STORE_INDEX_ENTRY;
+	offset = GetBE64(entry + 8);
+	length = GetBE32(entry + 16);
+	if (offset < 4 || offset > store->pack_length || length > store->pack_length - offset)
+	    break;
+	if (StoreInsert(store, GetBE64(entry), offset, length) != 0)
+	    goto error;
+    }
+    store->index_length = 4 + (uint64_t)i * STORE_INDEX_ENTRY;
+    if (store->index_length != (uint64_t)st.st_size && ftruncate(store->index_fd, store->index_length) != 0)
+	goto error;
+
+    free(index);
+    return store;
+
+ error:
+    free(index);
+    PDB_StoreClose(store);
+    return NULL;
+}
+
+void PDB_StoreClose(PDB_Store* store)
+{
+    if (store == NULL)
+	return;
+    StoreUnref(store->map);
+    if (store->pack_fd >= 0)
+	close(store->pack_fd);
+    if (store->index_fd >= 0)
+	close(store->index_fd);
+    free(store->slots);
+    free(store->bodies);
+    free(store);
+}
 
-	/* offset */
-	fread(&val32, 4, 1, f);
-	record_offsets[i] = SWAP_BE_32(val32);
-	
-	/* attributes */
-	fread(&attr, 1, 1, f);
-	pdb->records[i].attributes = attr;
+int PDB_StorePut(PDB_Store* store, struct PDB* pdb, void** manifest, unsigned int* length)
+{
+    unsigned int entry_size = EntrySize(pdb->attributes);
+    const unsigned char* data;
+    unsigned char* buf;
+    unsigned char* p;
+    PatchBuf pending;
+    uint64_t offset;
+    unsigned int size, i;
+    int result = -1;
+
+    *manifest = NULL;
+    *length = 0;
+    if (pdb->num_records > 0xFFFF || pdb->header_only)
+	return -1;
+
+    size = STORE_MANIFEST_FIXED + pdb->num_records * (entry_size + 8);
+    buf = (unsigned char *)Malloc(size);
+    memset(&pending, 0, sizeof (pending));
+    pending.capacity = 4096;
+    pending.data = (unsigned char *)Malloc(pending.capacity);
+    if (buf == NULL || pending.data == NULL)
+	goto done;
 
-	/* unique ID; don't care */
-	fread(&val32, 3, 1, f);
+    memcpy(buf, STORE_MANIFEST_MAGIC, 4);
+    PackHeader(pdb, buf + 4, 0);
+    p = buf + 4 + PDB_HEADER_SIZE;
+    offset = 0;
+    if (pdb->app_info_length > 0 &&
+	StoreAdd(store, pdb->app_info_block, pdb->app_info_length, &offset, &pending) != 0)
+	goto done;
+    PutBE64(p, offset);
+    PutBE32(p + 8, pdb->app_info_length);
+    p += 12;
+    offset = 0;
+    if (pdb->sort_info_length > 0 &&
+	StoreAdd(store, pdb->sort_info_block, pdb->sort_info_length, &offset, &pending) != 0)
+	goto done;
+    PutBE64(p, offset);
+    PutBE32(p + 8, pdb->sort_info_length);
+    p += 12;
+
+    for (i = 0; i < pdb->num_records; i++, p += entry_size + 8) {
+	PDB_Record* r = &pdb->records[i];
+	offset = 0;
+	if (r->length > 0) {
+	    data = RecordBytes(pdb, i);
+	    if (data == NULL || StoreAdd(store, data, r->length, &offset, &pending) != 0)
+		goto done;
+	}
+	PackEntry(pdb, p, r->length, r);
+	PutBE64(p + entry_size, offset);
     }
+    result = 0;
 
-    /* Read AppInfo area. */
-    if (app_info_offset != 0) {
-	pdb->app_info_length = record_offsets[0] - app_info_offset;
-	pdb->app_info_block = malloc(pdb->app_info_length);
-	if (pdb->app_info_block == NULL)
-	    goto error;
-	fseek(f, app_info_offset, SEEK_SET);
-	fread(pdb->app_info_block, pdb->app_info_length, 1, f);
+ done:
+    /* Bodies that made it into the pack get indexed, even on failure. */
+    if (pending.length > 0) {
+	if (WriteAt(store->index_fd, pending.data, pending.length, store->index_length) != 0)
+	    result = -1;
+	store->index_length += pending.length;
+    }
+    free(pending.data);
+    if (result != 0) {
+	free(buf);
+	return -1;
     }
+    *manifest = buf;
+    *length = size;
+    return 0;
+}
 
-    /* Read records. */
-    for (i = 0; i < num_records; i++) {
-	pdb->records[i].length = record_offsets[i+1] - record_offsets[i];
-	pdb->records[i].data = malloc(pdb->records[i].length);
-	if (pdb->records[i].data == NULL)
+int PDB_StoreGet(PDB_Store* store, const void* manifest, unsigned int length, struct PDB* pdb)
+{
+    const unsigned char* m = (const unsigned char *)manifest;
+    const unsigned char* p;
+    const unsigned char* data;
+    unsigned int app_info_offset, sort_info_offset, entry_size;
+    unsigned int num_records, i;
+    PDB_Record* r;
+
+    memset(pdb, 0, sizeof (struct PDB));
+    if (length < STORE_MANIFEST_FIXED || memcmp(m, STORE_MANIFEST_MAGIC, 4) != 0)
+	return -1;
+    num_records = UnpackHeader(pdb, m + 4, &app_info_offset, &sort_info_offset);
+    entry_size = EntrySize(pdb->attributes);
+    if (length != STORE_MANIFEST_FIXED + num_records * (entry_size + 8))
+	return -1;
+    if (StoreMapPack(store) != 0)
+	return -1;
+
+    p = m + 4 + PDB_HEADER_SIZE;
+    if (GetBE32(p + 8) > 0) {
+	data = StoreBytes(store, GetBE64(p), GetBE32(p + 8));
+	if (data == NULL || PDB_SetAppInfoBlock(pdb, data, GetBE32(p + 8)) != 0)
+	    goto error;
+    }
+    p += 12;
+    if (GetBE32(p + 8) > 0) {
+	data = StoreBytes(store, GetBE64(p), GetBE32(p + 8));
+	if (data == NULL || PDB_SetSortInfoBlock(pdb, data, GetBE32(p + 8)) != 0)
 	    goto error;
-	fseek(f, record_offsets[i], SEEK_SET);
-	fread(pdb->records[i].data, pdb->records[i].length, 1, f);
     }
+    p += 12;
 
-    free(record_offsets);
+    if (PDB_SetNumRecords(pdb, num_records) != 0)
+	goto error;
+    pdb->unique_id_seed = GetBE32(m + 4 + 68);
 
+    /* Records are lent straight out of the pack mapping, each holding a
+       reference to it. */
+    for (i = 0; i < num_records; i++, p += entry_size + 8) {
+	r = &pdb->records[i];
+	r->length = UnpackEntry(pdb, p, r);
+	if (r->length == 0)
+	    continue;
+	data = StoreBytes(store, GetBE64(p + entry_size), r->length);
+	if (data == NULL)
+	    goto error;
+	__atomic_add_fetch(&store->map->refs, 1, __ATOMIC_RELAXED);
+	r->data = (void *)data;
+	r->release = StoreRelease;
+	r->release_ctx = store->map;
+    }
     return 0;
 
  error:
-    fclose(f);
-    free(record_offsets);
     PDB_Free(pdb);
     return -1;
 }
 
+/* Sidecar index caches for PDB_OpenCached. A sidecar holds everything
+   PDB_OpenLazy reads from the front of a database, plus each record's
+   hash, so reopening the database reads the sidecar and nothing else.
+   It's keyed on the database's size, modification time and inode, which
+   any rewrite of the file changes. All numbers big endian:
+     "PDBx", the database's size (8), modification time in seconds (8)
+     and nanoseconds (4) and inode (8), then the length (4) of the header
+     and record list, those as read from the database, the AppInfo and
+     SortInfo blocks, a hash (8) per record, and a hash (8) of everything
+     before it, so a torn or damaged sidecar is never believed.
+   Sidecars are written to a temporary file and renamed into place, so
+   processes opening the same database side by side don't trip over each
+   other. */
 
-void PDB_Init(struct PDB* pdb, const char* name, unsigned int version, const char* type, const char* creator)
-{
-    memset(pdb, 0, sizeof (struct PDB));
-    strncpy(pdb->name, name, 31);
-    strncpy(pdb->type, type, 4);
-    strncpy(pdb->creator, creator, 4);
-    /* Times are in seconds since January 1904.
-       This probably isn't exactly right, but close enough. */
-    pdb->creation_time = time(NULL) + 2082801600;
-    pdb->modification_time = time(NULL) + 2082801600;
-    pdb->version = version;
-}
+#define SIDECAR_MAGIC  "PDBx"
+#define SIDECAR_KEY    32
+#define SIDECAR_FIXED  (SIDECAR_KEY + 4)
+#define SIDECAR_READ   (1 << 20)   /* bytes read at a time while hashing */
 
-void PDB_Free(struct PDB* pdb)
+/* The nanoseconds of a modification time are spelled differently from
+   one system to the next, and some don't keep them at all; there, a
+   rewrite within the same second has to change the size or inode to be
+   noticed. */
+#if defined(__APPLE__)
+#define MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#elif defined(__linux__) || (defined(_POSIX_VERSION) && _POSIX_VERSION >= 200809L)
+#define MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#else
+#define MTIME_NSEC(st) 0
+#endif
+
+static void SidecarKey(unsigned char* buf, const struct stat* st)
 {
-    PDB_SetAppInfoBlock(pdb, NULL, 0);
-    PDB_SetNumRecords(pdb, 0);
-    memset(pdb, 0, sizeof (struct PDB));
+    memcpy(buf, SIDECAR_MAGIC, 4);
+    PutBE64(buf + 4, st->st_size);
+    PutBE64(buf + 12, st->st_mtime);
+    PutBE32(buf + 20, MTIME_NSEC(st));
+    PutBE64(buf + 24, st->st_ino);
 }
 
-int PDB_SetAppInfoBlock(struct PDB* pdb, const void* block, unsigned int bytes)
+/* Opens the database open on fd, whose stat is st, lazily from its
+   sidecar. Takes over fd on success; on failure, pdb is left empty and
+   fd still open. */
+static int SidecarOpen(struct PDB* pdb, int fd, const struct stat* st, const char* cache_filename,
+		       unsigned int cache_bytes)
 {
-    void* old_block = pdb->app_info_block;
-    if (block != NULL && bytes > 0) {
-	pdb->app_info_block = malloc(bytes);	
-	if (pdb->app_info_block == NULL) {
-	    pdb->app_info_block = old_block;
-	    return -1;
-	}
-	pdb->app_info_length = bytes;
-    } else {
-	pdb->app_info_block = NULL;
-	pdb->app_info_length = 0;
+    unsigned char key[SIDECAR_KEY];
+    unsigned char* buf = NULL;
+    const unsigned char* p;
+    uint64_t* hashes = NULL;
+    unsigned int length, index_length;
+    unsigned int app_info_offset, sort_info_offset;
+    unsigned long start;
+    struct stat cst;
+    unsigned int i;
+    int cfd, result = -1;
+
+    cfd = open(cache_filename, O_RDONLY);
+    if (cfd < 0)
+	return -1;
+
+    start = StatClock();
+    if (fstat(cfd, &cst) != 0 || cst.st_size < SIDECAR_FIXED + PDB_HEADER_SIZE + 8 ||
+	cst.st_size > 0xFFFFFFFF)
+	goto done;
+    length = cst.st_size;
+    buf = (unsigned char *)Malloc(length);
+    if (buf == NULL || ReadAt(cfd, buf, length, 0) != 0)
+	goto done;
+    STAT_TIME(index_parse_ns, start);
+
+    SidecarKey(key, st);
+    if (memcmp(buf, key, SIDECAR_KEY) != 0 || GetBE64(buf + length - 8) != Hash64(buf, length - 8, 0))
+	goto done;
+
+    p = buf + SIDECAR_FIXED;
+    index_length = GetBE32(buf + SIDECAR_KEY);
+    if (index_length != PDB_HEADER_SIZE + GetBE16(p + 76) * EntrySize(GetBE16(p + 32)) ||
+	index_length > length - SIDECAR_FIXED - 8 ||
+	ParseIndex(pdb, p, st->st_size, &app_info_offset, &sort_info_offset) != 0)
+	goto done;
+    if (length != (uint64_t)SIDECAR_FIXED + index_length + pdb->app_info_length +
+	pdb->sort_info_length + (uint64_t)pdb->num_records * 8 + 8)
+	goto done;
+
+    p += index_length;
+    if (pdb->app_info_length > 0 && PDB_SetAppInfoBlock(pdb, p, pdb->app_info_length) != 0)
+	goto done;
+    p += pdb->app_info_length;
+    if (pdb->sort_info_length > 0 && PDB_SetSortInfoBlock(pdb, p, pdb->sort_info_length) != 0)
+	goto done;
+    p += pdb->sort_info_length;
+
+    hashes = (uint64_t *)Malloc((pdb->num_records > 0 ? pdb->num_records : 1) * sizeof (uint64_t));
+    if (hashes == NULL)
+	goto done;
+    for (i = 0; i < pdb->num_records; i++, p += 8) {
+	hashes[i] = GetBE64(p);
     }
-    free(old_block);
-    return 0;
+
+    /* Last, so that failing never leaves fd owned by pdb. */
+    if (LazyAttach(pdb, fd, buf + SIDECAR_FIXED, cache_bytes) != 0)
+	goto done;
+    pdb->lazy->hashes = hashes;
+    hashes = NULL;
+    result = 0;
+
+ done:
+    if (result != 0)
+	PDB_Free(pdb);
+    free(hashes);
+    free(buf);
+    close(cfd);
+    return result;
 }
 
-int PDB_SetNumRecords(struct PDB* pdb, unsigned int num)
+/* Hashes every record of a freshly opened lazy database. Records lie
+   back to back, so they're read a big run at a time, straight from the
+   file rather than through the cache. */
+static int SidecarHash(struct PDB* pdb)
 {
-    PDB_Record* new_data;
+    struct PDB_Lazy* lazy = pdb->lazy;
+    unsigned int num_records = pdb->num_records;
+    unsigned char* buf = NULL;
+    uint64_t* hashes;
+    unsigned int size = SIDECAR_READ;
+    unsigned int base, span;
+    unsigned long start;
+    unsigned int i, j, k;
 
-    if (num < pdb->num_records) {
-	unsigned int i;
-	for (i = num; i < pdb->num_records; i++) {
-	    free(pdb->records[i].data);
+    for (i = 0; i < num_records; i++) {
+	if (pdb->records[i].length > size)
+	    size = pdb->records[i].length;
+    }
+    hashes = (uint64_t *)Malloc((num_records > 0 ? num_records : 1) * sizeof (uint64_t));
+    if (hashes == NULL)
+	return -1;
+    if (num_records > 0) {
+	buf = (unsigned char *)Malloc(size);
+	if (buf == NULL)
+	    goto error;
+    }
+
+    for (i = 0; i < num_records; i = j) {
+	base = lazy->offsets[i];
+	span = 0;
+	for (j = i; j < num_records && lazy->offsets[j] - base + pdb->records[j].length <= size; j++) {
+	    span = lazy->offsets[j] - base + pdb->records[j].length;
 	}
-	if (num != 0) {
-	    new_data = (PDB_Record*)realloc(pdb->records, num * sizeof (struct PDB_Record));
-	    pdb->records = (new_data == NULL ? pdb->records : new_data);
-	} else {
-	    pdb->records = NULL;
-	}	
-	pdb->num_records = num;
-    } else if (num > pdb->num_records) {
-	unsigned int i;
-	new_data = (PDB_Record*)realloc(pdb->records, num * sizeof (struct PDB_Record));
-	if (new_data == NULL)
-	    return -1;
-	pdb->records = new_data;
-	for (i = pdb->num_records; i < num; i++) {
-	    memset(&pdb->records[i], 0, sizeof (struct PDB_Record));
+	start = StatClock();
+	if (ReadAt(lazy->fd, buf, span, base) != 0)
+	    goto error;
+	STAT_TIME(body_load_ns, start);
+	for (k = i; k < j; k++) {
+	    hashes[k] = Hash64(buf + (lazy->offsets[k] - base), pdb->records[k].length, 0);
 	}
-	pdb->num_records = num;
     }
+
+    free(buf);
+    lazy->hashes = hashes;
     return 0;
+
+ error:
+    free(buf);
+    free(hashes);
+    return -1;
 }
 
-int PDB_SetRecord(struct PDB* pdb, unsigned int rec, const void *data, unsigned int length, unsigned int attr)
+/* Writes the sidecar for a database opened and hashed from a file whose
+   stat is st. index holds its header and record list. */
+static int SidecarWrite(struct PDB* pdb, const struct stat* st, const unsigned char* index,
+			const char* cache_filename)
 {
-    void* new_data;
-    if (rec >= pdb->num_records)
+    unsigned int index_length = PDB_HEADER_SIZE + pdb->num_records * EntrySize(pdb->attributes);
+    uint64_t length = (uint64_t)SIDECAR_FIXED + index_length + pdb->app_info_length +
+	pdb->sort_info_length + (uint64_t)pdb->num_records * 8 + 8;
+    unsigned char* buf = NULL;
+    unsigned char* p;
+    char* temp = NULL;
+    unsigned int i;
+    int fd, result = -1;
+
+    if (length > 0xFFFFFFFF)
 	return -1;
+    buf = (unsigned char *)Malloc(length);
+    temp = (char *)Malloc(strlen(cache_filename) + 8);
+    if (buf == NULL || temp == NULL)
+	goto done;
+
+    SidecarKey(buf, st);
+    PutBE32(buf + SIDECAR_KEY, index_length);
+    p = buf + SIDECAR_FIXED;
+    memcpy(p, index, index_length);
+    p += index_length;
+    if (pdb->app_info_length > 0)
+	memcpy(p, pdb->app_info_block, pdb->app_info_length);
+    p += pdb->app_info_length;
+    if (pdb->sort_info_length > 0)
+	memcpy(p, pdb->sort_info_block, pdb->sort_info_length);
+    p += pdb->sort_info_length;
+    for (i = 0; i < pdb->num_records; i++, p += 8) {
+	PutBE64(p, pdb->lazy->hashes[i]);
+    }
+    PutBE64(p, Hash64(buf, length - 8, 0));
+
+    sprintf(temp, "%s.XXXXXX", cache_filename);
+    fd = mkstemp(temp);
+    if (fd < 0)
+	goto done;
+    result = WriteAt(fd, buf, length, 0);
+    if (close(fd) != 0)
+	result = -1;
+    if (result == 0 && rename(temp, cache_filename) != 0)
+	result = -1;
+    if (result != 0)
+	unlink(temp);
+
+ done:
+    free(temp);
+    free(buf);
+    return result;
+}
+
+int PDB_OpenCached(struct PDB* pdb, const char* filename, const char* cache_filename, unsigned int cache_bytes)
+{
+    unsigned char* index = NULL;
+    unsigned int file_length;
+    unsigned int app_info_offset, sort_info_offset;
+    struct stat st;
+    int fd;
+
+    memset(pdb, 0, sizeof (struct PDB));
 
-    new_data = realloc(pdb->records[rec].data, length);
-    if (new_data == NULL)
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
 	return -1;
+    if (fstat(fd, &st) != 0)
+	goto error;
+    if (SidecarOpen(pdb, fd, &st, cache_filename, cache_bytes) == 0)
+	return 0;
+
+    index = ReadIndex(fd, &file_length);
+    if (index == NULL || ParseIndex(pdb, index, file_length, &app_info_offset, &sort_info_offset) != 0 ||
+	LazyAttach(pdb, fd, index, cache_bytes) != 0 ||
+	LazyLoadBlocks(pdb, app_info_offset, sort_info_offset) != 0)
+	goto error;
 
-    pdb->records[rec].data = new_data;
-    memcpy(pdb->records[rec].data, data, length);
-    pdb->records[rec].attributes = attr;
-    pdb->records[rec].length = length;
+    /* Without hashes or a sidecar the database is still open, just as
+       PDB_OpenLazy would have it. A file that changed size since the
+       fstat gets no sidecar; the next open will try again. */
+    if (file_length == (uint64_t)st.st_size && SidecarHash(pdb) == 0)
+	SidecarWrite(pdb, &st, index, cache_filename);
 
+    free(index);
     return 0;
+
+ error:
+    if (pdb->lazy == NULL)
+	close(fd);
+    free(index);
+    PDB_Free(pdb);
+    return -1;
 }
 
-int PDB_LoadRecordFromFile(struct PDB* pdb, unsigned int rec, const char* filename, int terminate, unsigned int attr)
+/* PalmDOC compression. The compressed stream is a sequence of:
+     0x00, 0x09-0x7F   that byte, literally
+     0x01-0x08         that many following bytes, literally
+     0x80-0xBF         with the next byte, an 11-bit distance back into
+                       the output and a length of 3-10 bytes to copy
+     0xC0-0xFF         a space followed by the byte XOR 0x80
+   Matches are found through a hash of the next three bytes, chained
+   back through earlier positions with the same hash. */
+
+#define PALMDOC_HASH_BITS   12
+#define PALMDOC_MAX_DIST    2047
+#define PALMDOC_MIN_MATCH   3
+#define PALMDOC_MAX_MATCH   10
+#define PALMDOC_MAX_CHAIN   32
+
+static unsigned int PalmDocHash(const unsigned char* p)
 {
-    FILE* f;
-    void* data = NULL;
-    unsigned int length;
-    
-    f = fopen(filename, "rb");
-    if (f == NULL)
-	return -1;
-    
-    fseek(f, 0, SEEK_END);
-    length = ftell(f);
-    if (length > 0xFFFF) {
-	length = 0xFFFF;
-    }
-    
-    fseek(f, 0, SEEK_SET);    
-    data = malloc(length + (terminate ? 1 : 0));
-    if (data == NULL) {
-	fclose(f);
-	return -1;
-    }
-    fread(data, length, 1, f);
-    fclose(f);
-    if (terminate) {
-	((char *)data)[length] = '\0';
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & ((1 << PALMDOC_HASH_BITS) - 1);
+}
+
+static int PalmDocNeedsEscape(unsigned char c)
+{
+    return ((c >= 0x01 && c <= 0x08) || c >= 0x80);
+}
+
+unsigned int PDB_PalmDocCompress(const void* in, unsigned int length, void* out)
+{
+    const unsigned char* src = (const unsigned char *)in;
+    unsigned char* dst = (unsigned char *)out;
+    short head[1 << PALMDOC_HASH_BITS];
+    short prev[PDB_PALMDOC_RECORD_SIZE];
+    unsigned int pos = 0, inserted = 0, o = 0;
+
+    /* Not cut short: that would lose text behind a size that looks fine. */
+    if (length > PDB_PALMDOC_RECORD_SIZE)
+	return 0;
+    memset(head, 0xFF, sizeof (head));
+
+    while (pos < length) {
+	unsigned int best_len = 0, best_dist = 0;
+	unsigned char c;
+
+	/* Bring the hash chains up to the current position. */
+	for (; inserted < pos && inserted + PALMDOC_MIN_MATCH <= length; inserted++) {
+	    unsigned int h = PalmDocHash(src + inserted);
+	    prev[inserted] = head[h];
+	    head[h] = inserted;
+	}
+	inserted = (inserted < pos ? pos : inserted);
+
+	if (pos + PALMDOC_MIN_MATCH <= length) {
+	    unsigned int max_len = length - pos;
+	    int cand = head[PalmDocHash(src + pos)];
+	    int chain = PALMDOC_MAX_CHAIN;
+
+	    if (max_len > PALMDOC_MAX_MATCH)
+		max_len = PALMDOC_MAX_MATCH;
+	    for (; cand >= 0 && pos - cand <= PALMDOC_MAX_DIST && chain > 0; cand = prev[cand], chain--) {
+		unsigned int n = 0;
+		while (n < max_len && src[cand + n] == src[pos + n])
+		    n++;
+		if (n > best_len) {
+		    best_len = n;
+		    best_dist = pos - cand;
+		    if (n == max_len)
+			break;
+		}
+	    }
+	}
+
+	if (best_len >= PALMDOC_MIN_MATCH) {
+	    unsigned int code = 0x8000 | (best_dist << 3) | (best_len - PALMDOC_MIN_MATCH);
+	    dst[o++] = code >> 8;
+	    dst[o++] = code & 0xFF;
+	    pos += best_len;
+	    continue;
+	}
+
+	c = src[pos];
+	if (c == ' ' && pos + 1 < length && src[pos+1] >= 0x40 && src[pos+1] <= 0x7F) {
+	    dst[o++] = src[pos+1] ^ 0x80;
+	    pos += 2;
+	} else if (!PalmDocNeedsEscape(c)) {
+	    dst[o++] = c;
+	    pos++;
+	} else {
+	    /* Escape up to 8 bytes at once, running through to the last byte
+	       in that window that needs it; plain bytes in between cost no
+	       more inside the run. Whatever follows a short run is plain, so
+	       this never costs more than one extra byte per 8 of input. */
+	    unsigned int n = 1, i;
+	    for (i = 1; i < 8 && pos + i < length; i++) {
+		if (PalmDocNeedsEscape(src[pos+i]))
+		    n = i + 1;
+	    }
+	    dst[o++] = n;
+	    memcpy(dst + o, src + pos, n);
+	    o += n;
+	    pos += n;
+	}
     }
-    if (PDB_SetRecord(pdb, rec, data, length + (terminate ? 1 : 0), attr) < 0) {
-	fclose(f);
-	free(data);
-	return -1;
+
+    return o;
+}
+
+int PDB_PalmDocDecompress(const void* in, unsigned int length, void* out, unsigned int out_size)
+{
+    const unsigned char* src = (const unsigned char *)in;
+    unsigned char* dst = (unsigned char *)out;
+    unsigned int i = 0, o = 0;
+
+    while (i < length) {
+	unsigned char c = src[i++];
+
+	if (c == 0x00 || (c >= 0x09 && c <= 0x7F)) {
+	    if (o >= out_size)
+		return -1;
+	    dst[o++] = c;
+	} else if (c <= 0x08) {
+	    if (i + c > length || o + c > out_size)
+		return -1;
+	    memcpy(dst + o, src + i, c);
+	    i += c;
+	    o += c;
+	} else if (c >= 0xC0) {
+	    if (o + 2 > out_size)
+		return -1;
+	    dst[o++] = ' ';
+	    dst[o++] = c ^ 0x80;
+	} else {
+	    unsigned int code, dist, n;
+	    if (i >= length)
+		return -1;
+	    code = (c << 8) | src[i++];
+	    dist = (code >> 3) & 0x7FF;
+	    n = (code & 7) + PALMDOC_MIN_MATCH;
+	    if (dist == 0 || dist > o || o + n > out_size)
+		return -1;
+	    /* Byte by byte: the source may overlap what's being written. */
+	    for (; n > 0; n--, o++) {
+		dst[o] = dst[o - dist];
+	    }
+	}
     }
 
-    free(data);
+    return o;
+}
 
-    return 0;
+void PDB_PalmDocHeader(void* header, unsigned int text_length, unsigned int num_text_records)
+{
+    unsigned char* buf = (unsigned char *)header;
+
+    PutBE16(buf, 2);            /* compression: 2 = PalmDOC */
+    PutBE16(buf + 2, 0);        /* unused */
+    PutBE32(buf + 4, text_length);
+    PutBE16(buf + 8, num_text_records);
+    PutBE16(buf + 10, PDB_PALMDOC_RECORD_SIZE);
+    PutBE32(buf + 12, 0);       /* current reading position */
 }
@@ -15,8 +15,13 @@
 #ifndef PALMPDB_H
 #define PALMPDB_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* PDB header attributes. */
 
+#define PDB_ATTR_RESOURCE       1   /* resource database (.prc) */
 #define PDB_ATTR_READONLY       2   /* database is read-only */
 #define PDB_ATTR_DIRTY_APPINFO  4   /* dirty AppInfo area */
 #define PDB_ATTR_BACKUP         8   /* backup this database (no conduit exists) */
@@ -31,6 +36,11 @@
 #define PDB_REC_DIRTY          64   /* record modified */
 #define PDB_REC_DELETED       128   /* purge on next HotSync */
 
+struct PDB_Lazy;
+struct PDB_UIDIndex;
+struct PDB_ResourceIndex;
+typedef struct PDB_Writer PDB_Writer;
+
 /* In-memory PDB database representation.
    Not byte compatible with the file structure. */
 
@@ -65,13 +75,54 @@ typedef struct PDB {
     char creator[5];
     /* Application creator ID. Stored just like the type field. */
 
+    unsigned int unique_id_seed;
+    /* Last unique ID handed out to a record. New records get the next one.
+       Stored as 4-byte big endian. */
+
     void *app_info_block;
     unsigned int app_info_length;
     /* AppInfo block. For compatibility, it wise to make this
        exactly 512 byte, or not have an AppInfo block at all. */
 
+    void *sort_info_block;
+    unsigned int sort_info_length;
+    /* SortInfo block, app-defined like the AppInfo block, which it
+       follows in the file. Usually absent. */
+
     struct PDB_Record* records;
     unsigned int num_records;
+    unsigned int capacity;
+    /* Records the array has room for. It grows geometrically as records
+       are added, and doesn't shrink until emptied. See PDB_Reserve. */
+
+    void *map_base;
+    unsigned int map_length;
+    /* File mapping set up by PDB_MapFile. Record data and the AppInfo
+       block point straight into it. NULL for ordinary heap databases. */
+
+    void *arena;
+    unsigned int arena_length;
+    /* Single allocation holding the AppInfo block and every record body
+       as loaded by PDB_ReadFile. Records replaced later simply stop
+       pointing into it; the whole arena is released by PDB_Free. */
+
+    struct PDB_Lazy* lazy;
+    /* On-demand record loader set up by PDB_OpenLazy. NULL when every
+       record is already in memory. */
+
+    struct PDB_UIDIndex* uid_index;
+    /* Hash table behind PDB_FindRecordByUID. Built on first use and
+       dropped whenever records are added, removed or renumbered. */
+
+    struct PDB_ResourceIndex* resource_index;
+    /* Sorted (type, ID) table behind PDB_FindResource. Built on first use
+       and dropped whenever resources are added, removed or changed. */
+
+    int header_only;
+    /* Set by PDB_ReadHeader: the lengths are all there, but no record data
+       or AppInfo and SortInfo blocks were read. Such a database can only
+       be looked at; the writers, PDB_Diff, the patch functions and the
+       store all refuse it. */
 
 } PDB;
 
@@ -79,23 +130,206 @@ typedef struct PDB {
 typedef struct PDB_Record {
 
     unsigned int attributes;
-    /* Attributes. See constants above. */
+    /* Attributes. See constants above. Not stored for resources. */
 
     unsigned int length;
     /* Length in bytes. I think 64k is the max; haven't verified. */
 
+    unsigned int unique_id;
+    /* 24-bit ID that stays with the record across syncs.
+       Stored as 3-byte big endian in the record list. Not stored for resources. */
+
+    char resource_type[5];
+    unsigned int resource_id;
+    /* Resource type and ID, in resource databases (PDB_ATTR_RESOURCE) only.
+       The type is stored like the database type; the ID as 2-byte big endian. */
+
     void *data;
     /* Raw data. */
 
+    void (*release)(void* data, void* ctx);
+    void* release_ctx;
+    /* Set for data lent by the caller with PDB_BorrowRecord; called with
+       release_ctx when the record lets go of it. NULL otherwise. */
+
 } PDB_Record;
 
 
+/* Caller-supplied stream, for reading and writing databases somewhere
+   other than a named file (an upload body, an archive member...). */
+
+typedef struct PDB_IO {
+
+    long (*read)(void* ctx, void* buf, unsigned long length);
+    /* Reads up to length bytes. Returns the number read, 0 at the end of
+       the stream, or -1 on error. Needed for reading. */
+
+    long (*write)(void* ctx, const void* buf, unsigned long length);
+    /* Writes up to length bytes. Returns the number written, or -1 on
+       error. Needed for writing. */
+
+    int (*seek)(void* ctx, unsigned long offset);
+    /* Moves to the given offset from the start of the database.
+       Returns 0 on success, -1 on failure. Optional (may be NULL). */
+
+    long (*size)(void* ctx);
+    /* Returns the total length of the database, or -1 if unknown.
+       Optional (may be NULL). */
+
+    void* ctx;
+    /* Passed to every callback. */
+
+} PDB_IO;
+
+
 int PDB_WriteFile(struct PDB* pdb, const char* filename);
-/* Outputs a PDB file with the given contents.
+/* Outputs a PDB file with the given contents. Fails on a database the
+   format can't hold: more than 65535 records, or offsets past 4GB. The
+   other ways of writing a database have the same limits.
    Returns 0 on success, -1 on failure. */
 
 int PDB_ReadFile(struct PDB* pdb, const char* filename);
-/* Reads a PDB file into memory.
+/* Reads a PDB file into memory. The AppInfo block and all record data are
+   read with one call into a single allocation (see the arena field).
+   Returns 0 on success, -1 on failure or if the file is malformed. */
+
+int PDB_ReadHeader(struct PDB* pdb, const char* filename);
+/* Reads only the header and the record list of a PDB file, for looking
+   at a database without loading it. Everything is filled in, record
+   lengths included, except that record data and the AppInfo and SortInfo
+   blocks stay NULL (their lengths are set), and the header_only field is
+   set. The database can't be written out, compared with PDB_Diff, made
+   into or patched with PDB_MakePatch or PDB_ApplyPatch, or put in a
+   store; those all return failure for it, without touching any file.
+   The file isn't kept open. Returns 0 on success, -1 on failure or if
+   the file is malformed. */
+
+int PDB_MapFile(struct PDB* pdb, const char* filename);
+/* Maps a PDB file into memory instead of copying it. Record data and the
+   AppInfo block point into a private copy-on-write mapping of the file, so
+   nothing is read until it is touched. Records may still be replaced with
+   PDB_SetRecord. Release the database with PDB_Unmap (or PDB_Free).
+   Returns 0 on success, -1 on failure or if the file is malformed. */
+
+void PDB_Unmap(struct PDB* pdb);
+/* Frees a database opened with PDB_MapFile and removes its mapping. */
+
+int PDB_ReadIO(struct PDB* pdb, const PDB_IO* io);
+/* Reads a PDB from a caller-supplied stream, which must be positioned at
+   the start of the database. With a size callback the stream is read
+   front to back once, like PDB_ReadFile, using seek (if given) to skip
+   any gap before the data. Without one, the stream is read to its end
+   and parsed in memory. Returns 0 on success, -1 on failure or if the
+   data is malformed. */
+
+int PDB_WriteIO(struct PDB* pdb, const PDB_IO* io);
+/* Writes a PDB to a caller-supplied stream, front to back, without
+   seeking. The bytes are the same as PDB_WriteFile would produce.
+   Returns 0 on success, -1 on failure. */
+
+int PDB_ReadMemory(struct PDB* pdb, const void* buf, unsigned int length);
+/* Parses a complete PDB file image held in memory, in one bounds-checked
+   pass and without any stdio. The image is copied once into the arena
+   (see above), so buf may be freed as soon as this returns.
+   Returns 0 on success, -1 on failure or if the image is malformed. */
+
+int PDB_WriteMemory(struct PDB* pdb, void** buf, unsigned int* length);
+/* Builds the complete file image of a PDB in a single malloc'd buffer,
+   which the caller must free(). The bytes are the same as PDB_WriteFile
+   would produce. Returns 0 on success, -1 on failure. */
+
+int PDB_OpenLazy(struct PDB* pdb, const char* filename, unsigned int cache_bytes);
+/* Opens a PDB file, reading only the header, the record list and the
+   AppInfo block. Record lengths and attributes are filled in, but record
+   data stays NULL until fetched with PDB_GetRecordData. Fetched records
+   are cached; once the cache holds more than cache_bytes, the least
+   recently used records are dropped again. Records replaced with
+   PDB_SetRecord leave the cache and stay in memory. The file is kept
+   open until PDB_Free. Returns 0 on success, -1 on failure. */
+
+int PDB_OpenCached(struct PDB* pdb, const char* filename, const char* cache_filename, unsigned int cache_bytes);
+/* PDB_OpenLazy, with a sidecar index at cache_filename: a copy of the
+   header, the record list and the AppInfo and SortInfo blocks, plus the
+   PDB_HashRecord of every record. While the sidecar matches the file's
+   size, modification time and inode, opening takes a single read of it
+   and none of the file itself. Otherwise the file is opened as usual,
+   every record is hashed, and the sidecar is written afresh; failing to
+   write it doesn't fail the open. The hashes are what PDB_GetRecordHash,
+   PDB_Diff and PDB_MakePatch use, so unchanged databases can be compared
+   without reading any record data. Returns 0 on success, -1 on
+   failure. */
+
+const void* PDB_GetRecordData(struct PDB* pdb, unsigned int rec);
+/* Returns the data of a record, loading it from disk first if the
+   database was opened with PDB_OpenLazy. For lazy databases the pointer
+   is only good until the next PDB_GetRecordData call, which may evict it.
+   Returns NULL if rec is out of range or the record can't be loaded. */
+
+typedef struct PDB_FetchRequest {
+    struct PDB* pdb;
+    unsigned int rec;
+    int result;         /* set to 0 once the record is in memory, or -1 */
+} PDB_FetchRequest;
+
+int PDB_FetchBatch(PDB_FetchRequest* requests, unsigned int count);
+/* Loads a set of records, from any number of databases opened with
+   PDB_OpenLazy, with all the reads issued as one batch. Built with
+   PDB_IO_URING (make IO_URING=1), the reads go through io_uring with many
+   in flight at once, which pays off on cold storage; otherwise, or if the
+   kernel refuses io_uring, they are done one by one with pread. Loaded
+   records join their database's cache, and records already in memory are
+   left alone. Every record of a batch stays loaded until the batch ends,
+   even if together they are over the cache budget; later fetches trim
+   the cache again. Records of databases that aren't lazy count as
+   loaded. Returns 0 if every request succeeded, -1 if any failed. */
+
+int PDB_FetchRecords(struct PDB* pdb, const unsigned int* recs, unsigned int count);
+/* PDB_FetchBatch for count records of one database. If recs is NULL, every
+   record of the database is fetched. Returns 0 on success, -1 if any
+   record couldn't be loaded. */
+
+PDB_Writer* PDB_WriterOpen(const struct PDB* pdb, const char* filename, unsigned int max_records);
+/* Starts writing a PDB file one record at a time, for databases too big to
+   hold in memory. The header fields and the AppInfo and SortInfo blocks are
+   taken from pdb; its records are ignored. If max_records is nonzero, room
+   for that many record list entries is reserved up front and record bodies
+   go straight to their final place in the file; adding more records than
+   that fails, and any unused entries are left as padding. If max_records is zero, the
+   bodies are spooled to a temporary file and copied into place by
+   PDB_WriterClose. Returns NULL on failure. */
+
+int PDB_WriterAddRecord(PDB_Writer* writer, const void* data, unsigned int length, unsigned int attr);
+/* Appends a record to a database being written with PDB_WriterOpen.
+   The data is written out before this returns and is not kept. The record
+   gets the next unique ID from the seed in the pdb given to PDB_WriterOpen.
+   Returns 0 on success, -1 on failure. */
+
+int PDB_WriterAddResource(PDB_Writer* writer, const char* type, unsigned int id, const void* data, unsigned int length);
+/* Appends a resource to a resource database being written with
+   PDB_WriterOpen. PDB_WriterAddRecord is for record databases only, and
+   this is for resource databases only. Returns 0 on success, -1 on failure. */
+
+int PDB_WriterAddChunked(PDB_Writer* writer, const PDB_IO* io, unsigned int chunk_size, int terminate, unsigned int attr);
+/* Adds a caller-supplied stream, from its current position to its end, to
+   a database being written with PDB_WriterOpen, split into records as
+   PDB_AppendChunkedFromIO splits it. Only one chunk is held in memory at
+   a time. Returns the number of records added, or -1 on failure, when
+   some may have been added already. */
+
+int PDB_WriterClose(PDB_Writer* writer);
+/* Writes the header and record list, closes the file and frees the
+   writer, even on failure. When exactly max_records records were added
+   (or max_records was zero), the file is byte-identical to what
+   PDB_WriteFile would produce for the same records added with
+   PDB_SetNumRecords and PDB_SetRecord. Returns 0 on success, -1 on failure. */
+
+int PDB_UpdateRecordInFile(const char* filename, unsigned int rec, const void* data, unsigned int length, unsigned int attr);
+/* Replaces one record of a PDB file on disk without rewriting the rest.
+   If the length is unchanged, only the record body and its attribute byte
+   are written. Otherwise the data after the record is shifted and the
+   offsets of the following records are patched in the record list.
+   The header is left alone. The update is not atomic; a crash part way
+   through a resize leaves the file damaged.
    Returns 0 on success, -1 on failure. */
 
 void PDB_Init(struct PDB* pdb, const char* name, unsigned int version, const char* type, const char* creator);
@@ -112,9 +346,29 @@ int PDB_SetAppInfoBlock(struct PDB* pdb, const void* block, unsigned int bytes);
    If block is NULL, simply removes the previous block.
    Returns 0 on success, -1 on failure. */
 
+int PDB_SetSortInfoBlock(struct PDB* pdb, const void* block, unsigned int bytes);
+/* Sets a SortInfo block for this PDB, just like PDB_SetAppInfoBlock.
+   Returns 0 on success, -1 on failure. */
+
 int PDB_SetNumRecords(struct PDB* pdb, unsigned int num);
 /* Sets the number of records in a PDB. If there are already records in the database,
-   resizes the record list to accomodate. Returns 0 on success, -1 on failure. */
+   resizes the record list to accomodate. New records get fresh unique IDs from the
+   database's unique ID seed. Returns 0 on success, -1 on failure. */
+
+int PDB_Reserve(struct PDB* pdb, unsigned int capacity);
+/* Makes room for at least capacity records without changing the number
+   of records, so that many can then be added without reallocating.
+   Never shrinks. Returns 0 on success, -1 on failure. */
+
+int PDB_AppendRecords(struct PDB* pdb, unsigned int count);
+/* Adds count empty records to the end, as PDB_SetNumRecords would, for
+   filling in with PDB_SetRecord, PDB_AdoptRecord and friends.
+   Returns the number of the first new record, or -1 on failure. */
+
+int PDB_AppendRecord(struct PDB* pdb, const void* data, unsigned int length, unsigned int attr);
+/* Adds a record holding a copy of data to the end. Adding N records one
+   at a time takes O(N) time overall.
+   Returns the number of the new record, or -1 on failure. */
 
 int PDB_SetRecord(struct PDB* pdb, unsigned int rec, const void *data, unsigned int length, unsigned int attr);
 /* Sets the given record to the provided data. Makes a local copy of the data.
@@ -122,10 +376,240 @@ int PDB_SetRecord(struct PDB* pdb, unsigned int rec, const void *data, unsigned
    To simply wipe out a record, pass NULL data.   
    Returns 0 on success, -1 on failure. */
 
+int PDB_AdoptRecord(struct PDB* pdb, unsigned int rec, void* data, unsigned int length, unsigned int attr);
+/* Like PDB_SetRecord, but takes over data, which must have come from
+   malloc, instead of copying it. The library frees it when the record is
+   replaced or the database freed. On failure data still belongs to the
+   caller. Returns 0 on success, -1 on failure. */
+
+int PDB_BorrowRecord(struct PDB* pdb, unsigned int rec, const void* data, unsigned int length, unsigned int attr,
+		     void (*release)(void* data, void* ctx), void* ctx);
+/* Like PDB_SetRecord, but the record points at data without copying or
+   owning it. When the record is replaced or the database freed, release
+   (if not NULL) is called with data and ctx; until then data must stay
+   valid and unchanged. The library never writes through it; a later
+   PDB_SetRecord takes a copy first. Returns 0 on success, -1 on failure. */
+
+int PDB_SetRecordUID(struct PDB* pdb, unsigned int rec, unsigned int unique_id);
+/* Changes a record's unique ID. Use this rather than writing the unique_id
+   field directly, so that PDB_FindRecordByUID notices.
+   Returns 0 on success, -1 on failure. */
+
+int PDB_FindRecordByUID(struct PDB* pdb, unsigned int unique_id);
+/* Returns the number of the record with the given unique ID, or -1 if
+   there is none. If several records share an ID, the first one wins.
+   Runs in constant time once its hash table is built. */
+
+typedef const void* (*PDB_KeyFunc)(const void* data, unsigned int length, unsigned int* key_length, void* ctx);
+/* Finds the sort key of a record, given its data (NULL if it's empty),
+   and sets *key_length. The key must lie within the data. Keys are
+   compared bytewise, a key coming before any longer key it begins. */
+
+int PDB_SortRecords(struct PDB* pdb, PDB_KeyFunc key, void* ctx);
+/* Puts the records in order of their keys; records with equal keys keep
+   their order. Unique IDs and attributes go along with the records.
+   Large databases are sorted on several threads. A lazy database is
+   loaded whole. Returns 0 on success, -1 on failure. */
+
+int PDB_FindRecordByKey(struct PDB* pdb, const void* key, unsigned int key_length, PDB_KeyFunc key_func, void* ctx);
+/* Returns the number of the first record with the given key, or -1 if
+   there is none. The database must already be in order of key_func's
+   keys, as PDB_SortRecords leaves it. Binary search; a lazy database only
+   loads the records it looks at. */
+
+int PDB_SetResource(struct PDB* pdb, unsigned int rec, const char* type, unsigned int id, const void* data, unsigned int length);
+/* Sets the given entry of a resource database to a resource with the given
+   type and ID. Pass the type as an ordinary string. Makes a local copy of
+   the data. Returns 0 on success, -1 on failure. */
+
+int PDB_FindResource(struct PDB* pdb, const char* type, unsigned int id);
+/* Returns the number of the resource with the given type and ID in a
+   resource database, or -1 if there is none. If several match, the first
+   one wins. Binary search over a sorted index built on first use. */
+
 int PDB_LoadRecordFromFile(struct PDB* pdb, unsigned int rec, const char* filename, int terminate, unsigned int attr);
 /* Loads the first 64k of a file into a record. Applies the given attributes
    to the record. If terminate is nonzero, null-terminates the data. (Useful for
-   loading text files into records, for instance.)
+   loading text files into records, for instance.) The file is read straight
+   into the record's own buffer. Anything past 64k is left out; see
+   PDB_AppendChunkedFromFile for keeping it.
    Returns 0 on success, -1 on failure. */
 
+int PDB_LoadRecordFromIO(struct PDB* pdb, unsigned int rec, const PDB_IO* io, int terminate, unsigned int attr);
+/* Like PDB_LoadRecordFromFile, but reads the first 64k of a caller-supplied
+   stream from its current position. Only read (and optionally size) are
+   used. Returns 0 on success, -1 on failure. */
+
+int PDB_AppendChunkedFromFile(struct PDB* pdb, const char* filename, unsigned int chunk_size, int terminate, unsigned int attr);
+/* Appends a whole file of any length as consecutive records of chunk_size
+   bytes (1 to 65535), the last one shorter; nothing is cut off. If
+   terminate is nonzero, a null terminator follows the data, which may take
+   a record of its own. An empty file (without terminator) is one empty
+   record. Every record gets the given attributes. Returns the number of
+   the first record appended, the rest following it to the end of the
+   list, or -1 on failure, in which case none are left appended. */
+
+int PDB_AppendChunkedFromIO(struct PDB* pdb, const PDB_IO* io, unsigned int chunk_size, int terminate, unsigned int attr);
+/* Like PDB_AppendChunkedFromFile, but reads a caller-supplied stream from
+   its current position to its end. Only read is used. */
+
+int PDB_WriteRecordsToIO(struct PDB* pdb, unsigned int first, unsigned int count, const PDB_IO* io);
+/* Writes the data of count records from record first on, back to back,
+   to a caller-supplied stream: the reverse of PDB_AppendChunkedFromIO.
+   Only write is used. Records of a lazy database are loaded one at a
+   time, so a large input comes back without ever being whole in memory.
+   Returns 0 on success, -1 on failure. */
+
+/* Comparing databases. */
+
+unsigned long long PDB_HashRecord(const void* data, unsigned int length);
+/* Returns a fast, non-cryptographic 64-bit hash of length bytes. The same
+   bytes hash the same on every machine. */
+
+int PDB_GetRecordHash(struct PDB* pdb, unsigned int rec, unsigned long long* hash);
+/* Sets *hash to the PDB_HashRecord of a record's data. For a database
+   opened with PDB_OpenCached the hash comes from the sidecar index until
+   the record is replaced; otherwise the record is hashed, loading it
+   first if the database is lazy. Returns 0 on success, -1 if rec is out
+   of range or the record can't be loaded. */
+
+#define PDB_MATCH_POSITION  0   /* record N of one database is record N of the other */
+#define PDB_MATCH_ID        1   /* match records by unique ID, resources by type and ID */
+
+#define PDB_DIFF_ADDED       1  /* only in the new database */
+#define PDB_DIFF_REMOVED     2  /* only in the old database */
+#define PDB_DIFF_DATA        4  /* contents changed */
+#define PDB_DIFF_ATTRIBUTES  8  /* record attributes changed */
+#define PDB_DIFF_ID         16  /* unique ID, or resource type or ID, changed */
+
+typedef struct PDB_Change {
+    unsigned int what;  /* PDB_DIFF_* flags */
+    int old_rec;        /* record number in the old database, or -1 if added */
+    int new_rec;        /* record number in the new database, or -1 if removed */
+} PDB_Change;
+
+int PDB_Diff(struct PDB* old_pdb, struct PDB* new_pdb, int match, PDB_Change** changes, unsigned int* count);
+/* Compares the records of two databases, pairing them up as match says
+   (by position if one is a resource database and the other isn't).
+   Paired records are compared by length, then by PDB_HashRecord, so the
+   data of records of different lengths is never looked at. Lazy databases
+   are loaded as needed. Sets *changes to a malloc'd array, which the
+   caller must free(), of *count changed records: those of the new
+   database in order, then those removed from the old one. Header fields,
+   AppInfo and SortInfo blocks aren't compared. Returns 0 on success, -1 on failure. */
+
+int PDB_MakePatch(struct PDB* old_pdb, struct PDB* new_pdb, void** patch, unsigned int* length);
+/* Builds a compact binary patch that turns old_pdb into new_pdb, header
+   and AppInfo and SortInfo blocks included. Records whose data is already somewhere in
+   old_pdb, wherever they moved, are referred to rather than stored. Sets
+   *patch to a malloc'd buffer, which the caller must free(), of *length
+   bytes. Returns 0 on success, -1 on failure. */
+
+int PDB_ApplyPatch(struct PDB* old_pdb, const void* patch, unsigned int length, struct PDB* pdb);
+/* Builds the new database of a patch made by PDB_MakePatch into pdb, which
+   must not be old_pdb. old_pdb is left alone, and may be freed afterwards;
+   the result holds its data in one arena like PDB_ReadFile. Fails if the
+   patch is malformed or old_pdb isn't exactly the database it was made
+   against. Returns 0 on success, -1 on failure. */
+
+/* Content-addressed record store, for keeping many databases that share
+   records in far less space. Each distinct record body or AppInfo block
+   is stored once in an append-only pack file; the databases themselves
+   become small manifests. Not safe for use from several threads, or by
+   several processes, at once. */
+
+typedef struct PDB_Store PDB_Store;
+
+PDB_Store* PDB_StoreOpen(const char* pack_filename, const char* index_filename);
+/* Opens a store made of a pack file and its hash index, creating both if
+   they don't exist. The index is read into memory in one go. Returns NULL
+   on failure. */
+
+void PDB_StoreClose(PDB_Store* store);
+/* Closes a store. Databases from PDB_StoreGet may outlive it; the pack
+   mapping they point into goes when the last of them is freed. */
+
+int PDB_StorePut(PDB_Store* store, struct PDB* pdb, void** manifest, unsigned int* length);
+/* Adds every record body and the AppInfo block of pdb to the store, apart
+   from those already there, and sets *manifest to a malloc'd buffer of
+   *length bytes describing the database, which the caller keeps and
+   must eventually free(). Lazy databases are loaded as needed. Returns 0
+   on success, -1 on failure. */
+
+int PDB_StoreGet(PDB_Store* store, const void* manifest, unsigned int length, struct PDB* pdb);
+/* Rebuilds a database from its manifest. Record data isn't copied: the
+   records point straight into a shared mapping of the pack file, which
+   is made again only when the pack has grown since the last one, and
+   kept until no database from it is left. The result can be written out
+   with PDB_WriteFile, or changed like any other database.
+   Returns 0 on success, -1 on failure or if the manifest is malformed. */
+
+/* Instrumentation. Counters are kept for the whole process, across all
+   databases and threads, and only while enabled. */
+
+typedef struct PDB_Stats {
+
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long read_calls;
+    unsigned long write_calls;
+    unsigned long seek_calls;
+    /* File I/O. pread, pwrite and writev count as one call each, as do
+       the stdio calls made by the streaming writer. */
+
+    unsigned long malloc_calls;
+    unsigned long realloc_calls;
+    unsigned long bytes_allocated;
+    /* Allocations made by the library, and the bytes asked for. Frees
+       aren't counted. */
+
+    unsigned long header_parse_ns;
+    unsigned long index_parse_ns;
+    unsigned long body_load_ns;
+    unsigned long body_store_ns;
+    /* Wall time, in nanoseconds, spent reading and decoding the 78-byte
+       header, reading and decoding the record list, loading record data
+       and writing it out. */
+
+} PDB_Stats;
+
+void PDB_EnableStats(int enable);
+/* Turns the counters on (nonzero) or off. They start off, and cost next
+   to nothing while off. Turning them off keeps the totals so far. */
+
+void PDB_GetStats(PDB_Stats* stats);
+/* Copies the current totals into stats. */
+
+void PDB_ResetStats(void);
+/* Sets every counter back to zero. */
+
+/* PalmDOC (type TEXt, creator REAd) text compression. Text is split into
+   records of PDB_PALMDOC_RECORD_SIZE bytes, each compressed on its own,
+   behind a 16-byte header in record 0. */
+
+#define PDB_PALMDOC_RECORD_SIZE 4096
+#define PDB_PALMDOC_HEADER_SIZE 16
+
+#define PDB_PALMDOC_MAX_COMPRESSED(len) ((len) + ((len) + 7) / 8)
+/* Worst-case compressed size of len bytes of input. */
+
+unsigned int PDB_PalmDocCompress(const void* in, unsigned int length, void* out);
+/* Compresses up to PDB_PALMDOC_RECORD_SIZE bytes with the PalmDOC LZ77
+   scheme. out must have room for PDB_PALMDOC_MAX_COMPRESSED(length) bytes.
+   Safe to call from several threads at once. Returns the compressed size,
+   which is only 0 for empty input, or 0 without compressing anything if
+   length is over PDB_PALMDOC_RECORD_SIZE. */
+
+int PDB_PalmDocDecompress(const void* in, unsigned int length, void* out, unsigned int out_size);
+/* Decompresses one PalmDOC record into out. Returns the decompressed size,
+   or -1 if the data is corrupt or doesn't fit in out_size bytes. */
+
+void PDB_PalmDocHeader(void* header, unsigned int text_length, unsigned int num_text_records);
+/* Fills in the PDB_PALMDOC_HEADER_SIZE-byte record 0 of a compressed
+   PalmDOC database. */
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,260 @@
+/*
+
+  Palm Database (PDB) Access Library
+  C++ interface. Header only; link with palmpdb.o as usual.
+  Needs C++20 (for std::span).
+
+  This software was written by John R. Hall <kg4ruo@arrl.net>,
+  but it is in the public domain. I believe that free software
+  should be truly free and not encumbered by license hassles.
+  There is no warranty of any sort pertaining to this code.
+
+*/
+
+
+#ifndef PALMPDB_HPP
+#define PALMPDB_HPP
+
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "palmpdb.h"
+
+namespace palm {
+
+/* Thrown whenever the C library reports failure. */
+class Error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/* A record's bytes. Views into a mapped or read database stay good until
+   the record is replaced or the database goes away; views into a lazy
+   database only until the next record is fetched. */
+using RecordView = std::span<const std::byte>;
+
+/* Memory from malloc, for handing to Database::emplace_back. */
+struct FreeDeleter {
+    void operator()(std::byte* p) const noexcept { std::free(p); }
+};
+using Buffer = std::unique_ptr<std::byte[], FreeDeleter>;
+
+inline Buffer make_buffer(std::size_t length)
+{
+    std::byte* p = static_cast<std::byte*>(std::malloc(length > 0 ? length : 1));
+    if (p == nullptr)
+	throw std::bad_alloc();
+    return Buffer(p);
+}
+
+/* Owns one struct PDB. Move-only: the records are never deep-copied
+   behind your back, and PDB_Free runs exactly once. */
+class Database {
+public:
+    class iterator {
+    public:
+	using iterator_concept = std::forward_iterator_tag;
+	using iterator_category = std::input_iterator_tag;
+	using value_type = RecordView;
+	using difference_type = std::ptrdiff_t;
+	using reference = RecordView;
+
+	iterator() = default;
+	RecordView operator*() const { return db_->record(index_); }
+	iterator& operator++() { ++index_; return *this; }
+	iterator operator++(int) { iterator old = *this; ++index_; return old; }
+	bool operator==(const iterator& other) const { return index_ == other.index_; }
+
+    private:
+	friend class Database;
+	iterator(const Database* db, std::size_t index) : db_(db), index_(index) {}
+	const Database* db_ = nullptr;
+	std::size_t index_ = 0;
+    };
+
+    /* An empty database, as set up by PDB_Init. */
+    Database(const char* name, unsigned int version, const char* type, const char* creator)
+    {
+	PDB_Init(&pdb_, name, version, type, creator);
+    }
+
+    /* Reads a whole file into one allocation (PDB_ReadFile). */
+    static Database read(const char* filename)
+    {
+	Database db;
+	if (PDB_ReadFile(&db.pdb_, filename) != 0)
+	    throw Error(std::string("unable to read ") + filename);
+	return db;
+    }
+
+    /* Maps a file instead of reading it (PDB_MapFile). Record views point
+       straight into the mapping; nothing is copied. */
+    static Database map(const char* filename)
+    {
+	Database db;
+	if (PDB_MapFile(&db.pdb_, filename) != 0)
+	    throw Error(std::string("unable to map ") + filename);
+	return db;
+    }
+
+    /* Parses a file image held in memory (PDB_ReadMemory). */
+    static Database read(std::span<const std::byte> image)
+    {
+	Database db;
+	if (PDB_ReadMemory(&db.pdb_, image.data(), checked(image.size(), "palm::Database::read")) != 0)
+	    throw Error("unable to parse database image");
+	return db;
+    }
+
+    /* Loads records on demand, caching up to cache_bytes (PDB_OpenLazy). */
+    static Database open_lazy(const char* filename, unsigned int cache_bytes)
+    {
+	Database db;
+	if (PDB_OpenLazy(&db.pdb_, filename, cache_bytes) != 0)
+	    throw Error(std::string("unable to open ") + filename);
+	return db;
+    }
+
+    /* open_lazy, with a sidecar index at cache_filename (PDB_OpenCached). */
+    static Database open_cached(const char* filename, const char* cache_filename, unsigned int cache_bytes)
+    {
+	Database db;
+	if (PDB_OpenCached(&db.pdb_, filename, cache_filename, cache_bytes) != 0)
+	    throw Error(std::string("unable to open ") + filename);
+	return db;
+    }
+
+    ~Database() { PDB_Free(&pdb_); }
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
+    Database(Database&& other) noexcept : pdb_(other.pdb_)
+    {
+	std::memset(&other.pdb_, 0, sizeof (other.pdb_));
+    }
+
+    Database& operator=(Database&& other) noexcept
+    {
+	if (this != &other) {
+	    PDB_Free(&pdb_);
+	    pdb_ = other.pdb_;
+	    std::memset(&other.pdb_, 0, sizeof (other.pdb_));
+	}
+	return *this;
+    }
+
+    void write(const char* filename)
+    {
+	if (PDB_WriteFile(&pdb_, filename) != 0)
+	    throw Error(std::string("unable to write ") + filename);
+    }
+
+    std::size_t size() const { return pdb_.num_records; }
+    bool empty() const { return pdb_.num_records == 0; }
+
+    /* Fetches the record first if the database is lazy. */
+    RecordView record(std::size_t rec) const
+    {
+	if (rec >= pdb_.num_records)
+	    throw std::out_of_range("palm::Database::record");
+	const void* data = PDB_GetRecordData(const_cast<PDB*>(&pdb_), rec);
+	if (data == nullptr && pdb_.records[rec].length > 0)
+	    throw Error("unable to load record");
+	return RecordView(static_cast<const std::byte*>(data), pdb_.records[rec].length);
+    }
+
+    RecordView operator[](std::size_t rec) const { return record(rec); }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, pdb_.num_records); }
+
+    /* Room for at least n records, so appending that many never
+       reallocates the record list (PDB_Reserve). */
+    void reserve(std::size_t n)
+    {
+	if (PDB_Reserve(&pdb_, checked(n, "palm::Database::reserve")) != 0)
+	    throw std::bad_alloc();
+    }
+
+    std::size_t capacity() const { return pdb_.capacity; }
+
+    /* Appends a record that takes over data (PDB_AdoptRecord). */
+    void emplace_back(Buffer data, std::size_t length, unsigned int attr = 0)
+    {
+	unsigned int n = checked(length, "palm::Database::emplace_back");
+	std::size_t rec = grow();
+	if (PDB_AdoptRecord(&pdb_, rec, data.get(), n, attr) != 0) {
+	    PDB_SetNumRecords(&pdb_, rec);
+	    throw Error("unable to add record");
+	}
+	data.release();
+    }
+
+    /* Appends a record that refers to data without copying it
+       (PDB_BorrowRecord); data must outlive the record. */
+    void emplace_back(RecordView data, unsigned int attr = 0)
+    {
+	unsigned int n = checked(data.size(), "palm::Database::emplace_back");
+	std::size_t rec = grow();
+	if (PDB_BorrowRecord(&pdb_, rec, data.data(), n, attr, nullptr, nullptr) != 0) {
+	    PDB_SetNumRecords(&pdb_, rec);
+	    throw Error("unable to add record");
+	}
+    }
+
+    /* Appends a copy of data (PDB_SetRecord). */
+    void push_back(RecordView data, unsigned int attr = 0)
+    {
+	unsigned int n = checked(data.size(), "palm::Database::push_back");
+	std::size_t rec = grow();
+	if (PDB_SetRecord(&pdb_, rec, data.data(), n, attr) != 0) {
+	    PDB_SetNumRecords(&pdb_, rec);
+	    throw Error("unable to add record");
+	}
+    }
+
+    unsigned int attributes(std::size_t rec) const { return pdb_.records[rec].attributes; }
+    unsigned int unique_id(std::size_t rec) const { return pdb_.records[rec].unique_id; }
+
+    std::string_view name() const { return pdb_.name; }
+    std::string_view type() const { return pdb_.type; }
+    std::string_view creator() const { return pdb_.creator; }
+
+    /* The underlying C structure, for everything not wrapped here. */
+    PDB* get() { return &pdb_; }
+    const PDB* get() const { return &pdb_; }
+
+private:
+    Database() { std::memset(&pdb_, 0, sizeof (pdb_)); }
+
+    /* The C library counts in unsigned ints; a bigger size would wrap
+       round to a small one on the way in. */
+    static unsigned int checked(std::size_t n, const char* what)
+    {
+	if (n > UINT_MAX)
+	    throw std::length_error(what);
+	return static_cast<unsigned int>(n);
+    }
+
+    std::size_t grow()
+    {
+	int rec = PDB_AppendRecords(&pdb_, 1);
+	if (rec < 0)
+	    throw Error("unable to add record");
+	return rec;
+    }
+
+    PDB pdb_;
+};
+
+}
+
+#endif
@@ -0,0 +1,558 @@
+/*
+
+  Palm Database (PDB) Access Library
+  Synthetic database generator and library microbenchmarks.
+
+  This software was written by John R. Hall <kg4ruo@arrl.net>,
+  but it is in the public domain. I believe that free software
+  should be truly free and not encumbered by license hassles.
+  There is no warranty of any sort pertaining to this code.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "palmpdb.h"
+
+#define DEFAULT_RECORDS     10000
+#define DEFAULT_MIN_SIZE    16
+#define DEFAULT_MAX_SIZE    256
+#define DEFAULT_ITERATIONS  20
+#define DEFAULT_FILE        "pdbbench.tmp.pdb"
+
+enum { DIST_FIXED, DIST_UNIFORM, DIST_EXPONENTIAL };
+
+typedef struct BenchConfig {
+    unsigned int records;
+    unsigned int min_size;
+    unsigned int max_size;
+    int distribution;
+    unsigned int app_info_size;
+    unsigned int iterations;
+    unsigned long seed;
+    const char* filename;
+} BenchConfig;
+
+/* Small, fixed PRNG so generated databases are the same everywhere. */
+static unsigned long RandomNext(unsigned long* state)
+{
+    *state = *state * 6364136223846793005UL + 1442695040888963407UL;
+    return (*state >> 33);
+}
+
+static unsigned int RecordSize(const BenchConfig* cfg, unsigned long* state)
+{
+    unsigned int span = cfg->max_size - cfg->min_size;
+    double u;
+
+    switch (cfg->distribution) {
+    case DIST_FIXED:
+	return cfg->min_size;
+    case DIST_EXPONENTIAL:
+	/* Mostly small records with a long tail, like address books. */
+	u = (RandomNext(state) % 1000000) / 1000000.0;
+	return cfg->min_size + (unsigned int)(span * u * u * u);
+    default:
+	return cfg->min_size + (span > 0 ? RandomNext(state) % (span + 1) : 0);
+    }
+}
+
+/* Fills a PDB with synthetic records as described by cfg. */
+static int Generate(PDB* pdb, const BenchConfig* cfg)
+{
+    unsigned long state = cfg->seed;
+    unsigned char* buf;
+    unsigned int i, j;
+
+    PDB_Init(pdb, "Bench", 1, "DATA", "bnch");
+    buf = (unsigned char *)malloc(cfg->max_size > cfg->app_info_size ? cfg->max_size + 1 : cfg->app_info_size + 1);
+    if (buf == NULL)
+	return -1;
+    for (j = 0; j <= cfg->max_size || j <= cfg->app_info_size; j++) {
+	buf[j] = RandomNext(&state) & 0xFF;
+    }
+
+    if (cfg->app_info_size > 0 && PDB_SetAppInfoBlock(pdb, buf, cfg->app_info_size) < 0)
+	goto error;
+    if (PDB_SetNumRecords(pdb, cfg->records) < 0)
+	goto error;
+    for (i = 0; i < cfg->records; i++) {
+	if (PDB_SetRecord(pdb, i, buf, RecordSize(cfg, &state), 0) < 0)
+	    goto error;
+    }
+
+    free(buf);
+    return 0;
+
+ error:
+    free(buf);
+    PDB_Free(pdb);
+    return -1;
+}
+
+/* Fills a PDB with cfg->records random eight-digit hex words, as a
+   dictionary might have them, in no particular order. */
+static int GenerateWords(PDB* pdb, const BenchConfig* cfg)
+{
+    unsigned long state = cfg->seed;
+    char word[16];
+    unsigned int i;
+
+    PDB_Init(pdb, "Bench", 1, "DATA", "bnch");
+    if (PDB_Reserve(pdb, cfg->records) < 0)
+	return -1;
+    for (i = 0; i < cfg->records; i++) {
+	snprintf(word, sizeof (word), "%08lx", RandomNext(&state) & 0xFFFFFFFF);
+	if (PDB_AppendRecord(pdb, word, 8, 0) < 0) {
+	    PDB_Free(pdb);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static const void* WholeRecord(const void* data, unsigned int length, unsigned int* key_length, void* ctx)
+{
+    (void)ctx;
+    *key_length = length;
+    return data;
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Pushes a file out of the page cache, so the next read comes from the
+   disk. The file has to be written back first; dirty pages stay put. */
+static void DropCache(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+	return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static unsigned long PayloadBytes(const PDB* pdb)
+{
+    unsigned long bytes = pdb->app_info_length;
+    unsigned int i;
+
+    for (i = 0; i < pdb->num_records; i++) {
+	bytes += pdb->records[i].length;
+    }
+    return bytes;
+}
+
+/* Prints one result as a line of JSON, so runs can be diffed and graphed. */
+static void Report(const char* name, const BenchConfig* cfg, unsigned long bytes, double seconds)
+{
+    double per_op = seconds / cfg->iterations;
+
+    printf("{\"bench\": \"%s\", \"records\": %u, \"bytes\": %lu, \"iterations\": %u, "
+	   "\"ns_per_op\": %.0f, \"ns_per_record\": %.1f, \"mb_per_s\": %.1f}\n",
+	   name, cfg->records, bytes, cfg->iterations, per_op * 1e9,
+	   (cfg->records > 0 ? per_op * 1e9 / cfg->records : 0.0),
+	   (per_op > 0 ? bytes / per_op / 1e6 : 0.0));
+    fflush(stdout);
+}
+
+static int RunBenchmarks(const BenchConfig* cfg)
+{
+    unsigned char* buf;
+    unsigned int* order;
+    unsigned long bytes, state;
+    double start, elapsed;
+    unsigned int i, r, count;
+    PDB_Change* changes;
+    void* patch;
+    PDB_Store* store;
+    void* manifest;
+    unsigned int manifest_length;
+    char pack_name[1024], index_name[1024], cache_name[1024];
+    unsigned long long hash;
+    int batch;
+    PDB pdb, copy;
+
+    if (Generate(&pdb, cfg) < 0) {
+	printf("ERROR: unable to generate a database.\n");
+	return -1;
+    }
+    bytes = PayloadBytes(&pdb);
+
+    /* PDB_WriteFile */
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	if (PDB_WriteFile(&pdb, cfg->filename) < 0) {
+	    printf("ERROR: unable to write '%s'.\n", cfg->filename);
+	    PDB_Free(&pdb);
+	    return -1;
+	}
+    }
+    Report("write_file", cfg, bytes, Now() - start);
+
+    /* PDB_ReadFile, and PDB_Free of what it read */
+    elapsed = 0;
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	double t;
+	if (PDB_ReadFile(&copy, cfg->filename) < 0) {
+	    printf("ERROR: unable to read '%s'.\n", cfg->filename);
+	    PDB_Free(&pdb);
+	    return -1;
+	}
+	t = Now();
+	PDB_Free(&copy);
+	elapsed += Now() - t;
+    }
+    Report("read_file", cfg, bytes, Now() - start - elapsed);
+    Report("free_read", cfg, bytes, elapsed);
+
+    /* PDB_ReadHeader, which stops at the record list */
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	if (PDB_ReadHeader(&copy, cfg->filename) < 0) {
+	    printf("ERROR: unable to read '%s'.\n", cfg->filename);
+	    PDB_Free(&pdb);
+	    return -1;
+	}
+	PDB_Free(&copy);
+    }
+    Report("read_header", cfg, bytes, Now() - start);
+
+    /* Fetching every record of a lazy database from a cold page cache, in
+       random order so readahead doesn't help: one PDB_GetRecordData at a
+       time, then all at once with PDB_FetchRecords. */
+    order = (unsigned int *)malloc((cfg->records > 0 ? cfg->records : 1) * sizeof (unsigned int));
+    if (order == NULL) {
+	PDB_Free(&pdb);
+	return -1;
+    }
+    for (r = 0; r < cfg->records; r++) {
+	order[r] = r;
+    }
+    state = cfg->seed;
+    for (r = cfg->records; r > 1; r--) {
+	unsigned int j = RandomNext(&state) % r, tmp = order[r - 1];
+	order[r - 1] = order[j];
+	order[j] = tmp;
+    }
+    for (batch = 0; batch < 2; batch++) {
+	elapsed = 0;
+	for (i = 0; i < cfg->iterations; i++) {
+	    DropCache(cfg->filename);
+	    start = Now();
+	    if (PDB_OpenLazy(&copy, cfg->filename, 0xFFFFFFFF) < 0) {
+		printf("ERROR: unable to open '%s'.\n", cfg->filename);
+		free(order);
+		PDB_Free(&pdb);
+		return -1;
+	    }
+	    if (batch) {
+		PDB_FetchRecords(&copy, order, cfg->records);
+	    } else {
+		for (r = 0; r < cfg->records; r++) {
+		    PDB_GetRecordData(&copy, order[r]);
+		}
+	    }
+	    elapsed += Now() - start;
+	    PDB_Free(&copy);
+	}
+	Report(batch ? "fetch_cold_batch" : "fetch_cold_serial", cfg, bytes, elapsed);
+    }
+    free(order);
+
+    /* Hashing every record, as a change-detection pass would: through
+       PDB_OpenLazy, reading every body, then through PDB_OpenCached with
+       its sidecar index already written, reading none */
+    snprintf(cache_name, sizeof (cache_name), "%s.cache", cfg->filename);
+    unlink(cache_name);
+    if (PDB_OpenCached(&copy, cfg->filename, cache_name, 0xFFFFFFFF) == 0)
+	PDB_Free(&copy);
+    for (batch = 0; batch < 2; batch++) {
+	start = Now();
+	for (i = 0; i < cfg->iterations; i++) {
+	    if ((batch ? PDB_OpenCached(&copy, cfg->filename, cache_name, 0xFFFFFFFF) :
+		 PDB_OpenLazy(&copy, cfg->filename, 0xFFFFFFFF)) < 0) {
+		printf("ERROR: unable to open '%s'.\n", cfg->filename);
+		PDB_Free(&pdb);
+		return -1;
+	    }
+	    for (r = 0; r < copy.num_records; r++) {
+		PDB_GetRecordHash(&copy, r, &hash);
+	    }
+	    PDB_Free(&copy);
+	}
+	Report(batch ? "hash_cached" : "hash_lazy", cfg, bytes, Now() - start);
+    }
+    unlink(cache_name);
+
+    /* PDB_Diff by unique ID and PDB_MakePatch, against a copy with every
+       hundredth record changed */
+    if (PDB_ReadFile(&copy, cfg->filename) < 0) {
+	printf("ERROR: unable to read '%s'.\n", cfg->filename);
+	PDB_Free(&pdb);
+	return -1;
+    }
+    for (r = 0; r < copy.num_records; r += 100) {
+	PDB_SetRecord(&copy, r, "changed", 7, 0);
+    }
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	if (PDB_Diff(&pdb, &copy, PDB_MATCH_ID, &changes, &count) == 0)
+	    free(changes);
+    }
+    Report("diff", cfg, bytes, Now() - start);
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	if (PDB_MakePatch(&pdb, &copy, &patch, &count) == 0)
+	    free(patch);
+    }
+    Report("make_patch", cfg, bytes, Now() - start);
+
+    /* A content-addressed store holding the database: putting the copy
+       in, when all but every hundredth record is already there, then
+       reassembling the copy with PDB_StoreGet and PDB_WriteFile */
+    snprintf(pack_name, sizeof (pack_name), "%s.pack", cfg->filename);
+    snprintf(index_name, sizeof (index_name), "%s.idx", cfg->filename);
+    unlink(pack_name);
+    unlink(index_name);
+    store = PDB_StoreOpen(pack_name, index_name);
+    if (store == NULL || PDB_StorePut(store, &pdb, &manifest, &manifest_length) < 0) {
+	printf("ERROR: unable to set up a store.\n");
+	PDB_StoreClose(store);
+	PDB_Free(&copy);
+	PDB_Free(&pdb);
+	return -1;
+    }
+    free(manifest);
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	manifest = NULL;
+	if (PDB_StorePut(store, &copy, &manifest, &manifest_length) == 0 && i + 1 < cfg->iterations)
+	    free(manifest);
+    }
+    Report("store_put_shared", cfg, bytes, Now() - start);
+    PDB_Free(&copy);
+    if (manifest == NULL) {
+	PDB_StoreClose(store);
+	PDB_Free(&pdb);
+	return -1;
+    }
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	if (PDB_StoreGet(store, manifest, manifest_length, &copy) == 0) {
+	    PDB_WriteFile(&copy, cfg->filename);
+	    PDB_Free(&copy);
+	}
+    }
+    Report("store_reassemble", cfg, bytes, Now() - start);
+    free(manifest);
+    PDB_StoreClose(store);
+    unlink(pack_name);
+    unlink(index_name);
+
+    /* PDB_SetRecord over an existing database, alternating sizes so
+       every call has to resize the record. */
+    buf = (unsigned char *)calloc(cfg->max_size + 1, 1);
+    if (buf == NULL) {
+	PDB_Free(&pdb);
+	return -1;
+    }
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	for (r = 0; r < pdb.num_records; r++) {
+	    PDB_SetRecord(&pdb, r, buf, ((r + i) & 1) ? cfg->min_size : cfg->max_size, 0);
+	}
+    }
+    Report("set_record", cfg, bytes, Now() - start);
+    free(buf);
+    PDB_Free(&pdb);
+
+    /* PDB_SetNumRecords growth one record at a time, as makepdb did */
+    elapsed = 0;
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	double t;
+	PDB_Init(&pdb, "Bench", 1, "DATA", "bnch");
+	for (r = 0; r < cfg->records; r++) {
+	    PDB_SetNumRecords(&pdb, r + 1);
+	}
+	t = Now();
+	PDB_Free(&pdb);
+	elapsed += Now() - t;
+    }
+    Report("grow_records", cfg, 0, Now() - start - elapsed);
+
+    /* PDB_AppendRecord, which is what makepdb does now */
+    buf = (unsigned char *)calloc(cfg->max_size + 1, 1);
+    if (buf == NULL)
+	return -1;
+    elapsed = 0;
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	double t;
+	PDB_Init(&pdb, "Bench", 1, "DATA", "bnch");
+	for (r = 0; r < cfg->records; r++) {
+	    PDB_AppendRecord(&pdb, buf, cfg->min_size, 0);
+	}
+	t = Now();
+	PDB_Free(&pdb);
+	elapsed += Now() - t;
+    }
+    Report("append_record", cfg, (unsigned long)cfg->records * cfg->min_size, Now() - start - elapsed);
+    free(buf);
+
+    /* PDB_SortRecords on a dictionary of words, then looking every word
+       up with PDB_FindRecordByKey */
+    elapsed = 0;
+    for (i = 0; i < cfg->iterations; i++) {
+	if (GenerateWords(&pdb, cfg) < 0)
+	    return -1;
+	start = Now();
+	PDB_SortRecords(&pdb, WholeRecord, NULL);
+	elapsed += Now() - start;
+	if (i + 1 < cfg->iterations)
+	    PDB_Free(&pdb);
+    }
+    Report("sort_records", cfg, (unsigned long)cfg->records * 8, elapsed);
+    if (GenerateWords(&copy, cfg) < 0) {
+	PDB_Free(&pdb);
+	return -1;
+    }
+    start = Now();
+    for (i = 0; i < cfg->iterations; i++) {
+	for (r = 0; r < copy.num_records; r++) {
+	    PDB_FindRecordByKey(&pdb, copy.records[r].data, 8, WholeRecord, NULL);
+	}
+    }
+    Report("find_by_key", cfg, (unsigned long)cfg->records * 8, Now() - start);
+    PDB_Free(&copy);
+    PDB_Free(&pdb);
+
+    /* PDB_Free of a database built record by record on the heap */
+    elapsed = 0;
+    for (i = 0; i < cfg->iterations; i++) {
+	if (Generate(&pdb, cfg) < 0)
+	    return -1;
+	start = Now();
+	PDB_Free(&pdb);
+	elapsed += Now() - start;
+    }
+    Report("free_heap", cfg, bytes, elapsed);
+
+    unlink(cfg->filename);
+    return 0;
+}
+
+static int ParseDistribution(const char* name)
+{
+    if (!strcmp(name, "fixed"))
+	return DIST_FIXED;
+    if (!strcmp(name, "exp"))
+	return DIST_EXPONENTIAL;
+    if (!strcmp(name, "uniform"))
+	return DIST_UNIFORM;
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    const char* output = NULL;
+    int arg;
+    PDB pdb;
+
+    cfg.records = DEFAULT_RECORDS;
+    cfg.min_size = DEFAULT_MIN_SIZE;
+    cfg.max_size = DEFAULT_MAX_SIZE;
+    cfg.distribution = DIST_UNIFORM;
+    cfg.app_info_size = 0;
+    cfg.iterations = DEFAULT_ITERATIONS;
+    cfg.seed = 1;
+    cfg.filename = DEFAULT_FILE;
+
+    if (argc < 2)
+	goto usage;
+
+    arg = 2;
+    if (!strcmp(argv[1], "gen")) {
+	if (argc < 3)
+	    goto usage;
+	output = argv[2];
+	arg = 3;
+    } else if (strcmp(argv[1], "run")) {
+	goto usage;
+    }
+
+    for (; arg < argc; arg++) {
+	if (arg >= argc-1) goto usage;
+	if (!strcmp(argv[arg], "--records")) {
+	    cfg.records = strtoul(argv[++arg], NULL, 10);
+	} else if (!strcmp(argv[arg], "--min-size")) {
+	    cfg.min_size = strtoul(argv[++arg], NULL, 10);
+	} else if (!strcmp(argv[arg], "--max-size")) {
+	    cfg.max_size = strtoul(argv[++arg], NULL, 10);
+	} else if (!strcmp(argv[arg], "--dist")) {
+	    cfg.distribution = ParseDistribution(argv[++arg]);
+	    if (cfg.distribution < 0) goto usage;
+	} else if (!strcmp(argv[arg], "--appinfo")) {
+	    cfg.app_info_size = strtoul(argv[++arg], NULL, 10);
+	} else if (!strcmp(argv[arg], "--iterations")) {
+	    cfg.iterations = strtoul(argv[++arg], NULL, 10);
+	} else if (!strcmp(argv[arg], "--seed")) {
+	    cfg.seed = strtoul(argv[++arg], NULL, 10);
+	} else if (!strcmp(argv[arg], "--file")) {
+	    cfg.filename = argv[++arg];
+	} else {
+	    goto usage;
+	}
+    }
+
+    if (cfg.max_size < cfg.min_size)
+	cfg.max_size = cfg.min_size;
+    if (cfg.iterations == 0)
+	cfg.iterations = 1;
+
+    if (output != NULL) {
+	if (Generate(&pdb, &cfg) < 0 || PDB_WriteFile(&pdb, output) < 0) {
+	    printf("ERROR: unable to generate '%s'.\n", output);
+	    return EXIT_FAILURE;
+	}
+	PDB_Free(&pdb);
+	return EXIT_SUCCESS;
+    }
+
+    return (RunBenchmarks(&cfg) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+ usage:
+
+    printf("Usage: %s gen filename.pdb [options]\n"
+	   "       %s run [options]\n\n"
+	   "  gen writes a synthetic database; run benchmarks the library on one\n"
+	   "  and prints a line of JSON per benchmark.\n\n"
+	   "Options:\n"
+	   "    --records <n>       number of records (default %u)\n"
+	   "    --min-size <bytes>  smallest record (default %u)\n"
+	   "    --max-size <bytes>  largest record (default %u)\n"
+	   "    --dist <name>       record size distribution: fixed, uniform or exp\n"
+	   "                        (mostly small with a long tail; default uniform)\n"
+	   "    --appinfo <bytes>   AppInfo block size (default none)\n"
+	   "    --seed <n>          random seed, for reproducible databases\n"
+	   "    --iterations <n>    repetitions of each benchmark (default %u)\n"
+	   "    --file <path>       scratch file for run (default %s)\n",
+	   argv[0], argv[0], DEFAULT_RECORDS, DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE,
+	   DEFAULT_ITERATIONS, DEFAULT_FILE);
+
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,312 @@
+/*
+
+  Palm Database (PDB) Access Library
+  Utility for comparing PDB files and patching one into another.
+
+  This software was written by John R. Hall <kg4ruo@arrl.net>,
+  but it is in the public domain. I believe that free software
+  should be truly free and not encumbered by license hassles.
+  There is no warranty of any sort pertaining to this code.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "palmpdb.h"
+
+/* Exit codes, as diff(1) has them. */
+#define SAME       0
+#define DIFFERENT  1
+#define TROUBLE    2
+
+static int Open(PDB* pdb, const char* filename)
+{
+    if (PDB_MapFile(pdb, filename) < 0) {
+	printf("Unable to read '%s'.\n", filename);
+	return -1;
+    }
+    return 0;
+}
+
+static void Describe(PDB* pdb, int rec, char* buf, size_t size)
+{
+    PDB_Record* r = &pdb->records[rec];
+
+    if (pdb->attributes & PDB_ATTR_RESOURCE)
+	snprintf(buf, size, "%d (%s %u)", rec, r->resource_type, r->resource_id);
+    else
+	snprintf(buf, size, "%d (UID %06Xh)", rec, r->unique_id);
+}
+
+/* Prints the header fields that differ, unless quiet. Returns how many do. */
+static int DiffHeaders(PDB* a, PDB* b, int quiet)
+{
+    int n = 0;
+
+    if (strcmp(a->name, b->name)) {
+	if (!quiet)
+	    printf("Title:         '%s' -> '%s'\n", a->name, b->name);
+	n++;
+    }
+    if (a->attributes != b->attributes) {
+	if (!quiet)
+	    printf("Attributes:    %Xh -> %Xh\n", a->attributes, b->attributes);
+	n++;
+    }
+    if (a->version != b->version) {
+	if (!quiet)
+	    printf("Version:       %u -> %u\n", a->version, b->version);
+	n++;
+    }
+    if (a->creation_time != b->creation_time) {
+	if (!quiet)
+	    printf("Creation time: %u -> %u\n", a->creation_time, b->creation_time);
+	n++;
+    }
+    if (a->modification_time != b->modification_time) {
+	if (!quiet)
+	    printf("Mod time:      %u -> %u\n", a->modification_time, b->modification_time);
+	n++;
+    }
+    if (a->backup_time != b->backup_time) {
+	if (!quiet)
+	    printf("Backup time:   %u -> %u\n", a->backup_time, b->backup_time);
+	n++;
+    }
+    if (strcmp(a->type, b->type)) {
+	if (!quiet)
+	    printf("Type ID:       %s -> %s\n", a->type, b->type);
+	n++;
+    }
+    if (strcmp(a->creator, b->creator)) {
+	if (!quiet)
+	    printf("Creator ID:    %s -> %s\n", a->creator, b->creator);
+	n++;
+    }
+    if (a->unique_id_seed != b->unique_id_seed) {
+	if (!quiet)
+	    printf("UID seed:      %u -> %u\n", a->unique_id_seed, b->unique_id_seed);
+	n++;
+    }
+    if (a->app_info_length != b->app_info_length ||
+	(a->app_info_length > 0 && memcmp(a->app_info_block, b->app_info_block, a->app_info_length))) {
+	if (!quiet)
+	    printf("App info:      %u -> %u bytes, changed\n", a->app_info_length, b->app_info_length);
+	n++;
+    }
+    if (a->sort_info_length != b->sort_info_length ||
+	(a->sort_info_length > 0 && memcmp(a->sort_info_block, b->sort_info_block, a->sort_info_length))) {
+	if (!quiet)
+	    printf("Sort info:     %u -> %u bytes, changed\n", a->sort_info_length, b->sort_info_length);
+	n++;
+    }
+    return n;
+}
+
+static int Compare(const char* old_name, const char* new_name, int match, int quiet)
+{
+    unsigned int added = 0, removed = 0, modified = 0, other = 0;
+    PDB_Change* changes;
+    unsigned int count, i;
+    char a[64], b[64];
+    int headers, result = TROUBLE;
+    PDB old_pdb, new_pdb;
+
+    if (Open(&old_pdb, old_name) < 0)
+	return TROUBLE;
+    if (Open(&new_pdb, new_name) < 0) {
+	PDB_Free(&old_pdb);
+	return TROUBLE;
+    }
+
+    if (PDB_Diff(&old_pdb, &new_pdb, match, &changes, &count) < 0) {
+	printf("Unable to compare '%s' and '%s'.\n", old_name, new_name);
+	goto done;
+    }
+
+    headers = DiffHeaders(&old_pdb, &new_pdb, quiet);
+    result = (count > 0 || headers > 0 ? DIFFERENT : SAME);
+    if (quiet) {
+	if (result == DIFFERENT)
+	    printf("Databases %s and %s differ\n", old_name, new_name);
+	free(changes);
+	goto done;
+    }
+
+    for (i = 0; i < count; i++) {
+	PDB_Change* c = &changes[i];
+
+	if (c->what & PDB_DIFF_ADDED) {
+	    Describe(&new_pdb, c->new_rec, b, sizeof (b));
+	    printf("Added:    %s, %u bytes\n", b, new_pdb.records[c->new_rec].length);
+	    added++;
+	    continue;
+	}
+	if (c->what & PDB_DIFF_REMOVED) {
+	    Describe(&old_pdb, c->old_rec, a, sizeof (a));
+	    printf("Removed:  %s, %u bytes\n", a, old_pdb.records[c->old_rec].length);
+	    removed++;
+	    continue;
+	}
+
+	Describe(&old_pdb, c->old_rec, a, sizeof (a));
+	Describe(&new_pdb, c->new_rec, b, sizeof (b));
+	printf("Changed:  %s -> %s:", a, b);
+	if (c->what & PDB_DIFF_DATA) {
+	    printf(" data (%u -> %u bytes)", old_pdb.records[c->old_rec].length,
+		   new_pdb.records[c->new_rec].length);
+	    modified++;
+	} else {
+	    other++;
+	}
+	if (c->what & PDB_DIFF_ATTRIBUTES)
+	    printf(" attributes (%Xh -> %Xh)", old_pdb.records[c->old_rec].attributes,
+		   new_pdb.records[c->new_rec].attributes);
+	if (c->what & PDB_DIFF_ID)
+	    printf(" ID");
+	printf("\n");
+    }
+    printf("%u added, %u removed, %u modified, %u with other changes",
+	   added, removed, modified, other);
+    printf(headers > 0 ? "; header differs.\n" : ".\n");
+    free(changes);
+
+ done:
+    PDB_Free(&new_pdb);
+    PDB_Free(&old_pdb);
+    return result;
+}
+
+static int MakePatch(const char* patch_name, const char* old_name, const char* new_name)
+{
+    void* patch = NULL;
+    unsigned int length = 0;
+    int result = TROUBLE;
+    PDB old_pdb, new_pdb;
+    FILE* f;
+
+    if (Open(&old_pdb, old_name) < 0)
+	return TROUBLE;
+    if (Open(&new_pdb, new_name) < 0) {
+	PDB_Free(&old_pdb);
+	return TROUBLE;
+    }
+
+    if (PDB_MakePatch(&old_pdb, &new_pdb, &patch, &length) < 0) {
+	printf("Unable to make a patch from '%s' to '%s'.\n", old_name, new_name);
+	goto done;
+    }
+
+    f = fopen(patch_name, "wb");
+    if (f == NULL || fwrite(patch, 1, length, f) != length) {
+	printf("Unable to write '%s'.\n", patch_name);
+	if (f != NULL)
+	    fclose(f);
+	goto done;
+    }
+    if (fclose(f) != 0) {
+	printf("Unable to write '%s'.\n", patch_name);
+	goto done;
+    }
+    result = SAME;
+
+ done:
+    free(patch);
+    PDB_Free(&new_pdb);
+    PDB_Free(&old_pdb);
+    return result;
+}
+
+static int ApplyPatch(const char* patch_name, const char* old_name, const char* out_name)
+{
+    unsigned char* patch = NULL;
+    long length;
+    int result = TROUBLE;
+    PDB old_pdb, new_pdb;
+    FILE* f;
+
+    f = fopen(patch_name, "rb");
+    if (f == NULL) {
+	printf("Unable to read '%s'.\n", patch_name);
+	return TROUBLE;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (length >= 0 && (unsigned long)length <= 0xFFFFFFFF)
+	patch = (unsigned char *)malloc(length > 0 ? length : 1);
+    if (patch == NULL || fread(patch, 1, length, f) != (size_t)length) {
+	printf("Unable to read '%s'.\n", patch_name);
+	fclose(f);
+	free(patch);
+	return TROUBLE;
+    }
+    fclose(f);
+
+    if (Open(&old_pdb, old_name) < 0) {
+	free(patch);
+	return TROUBLE;
+    }
+
+    if (PDB_ApplyPatch(&old_pdb, patch, length, &new_pdb) < 0) {
+	printf("Unable to apply '%s' to '%s'; it's damaged or for another database.\n",
+	       patch_name, old_name);
+    } else {
+	if (PDB_WriteFile(&new_pdb, out_name) < 0)
+	    printf("Unable to write '%s'.\n", out_name);
+	else
+	    result = SAME;
+	PDB_Free(&new_pdb);
+    }
+
+    PDB_Free(&old_pdb);
+    free(patch);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    int match = PDB_MATCH_ID;
+    int quiet = 0;
+    int arg = 1;
+
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+	if (!strcmp(argv[arg], "--position")) {
+	    match = PDB_MATCH_POSITION;
+	} else if (!strcmp(argv[arg], "-q")) {
+	    quiet = 1;
+	} else if (!strcmp(argv[arg], "--patch") && argc - arg == 4) {
+	    return MakePatch(argv[arg+1], argv[arg+2], argv[arg+3]);
+	} else if (!strcmp(argv[arg], "--apply") && argc - arg == 4) {
+	    return ApplyPatch(argv[arg+1], argv[arg+2], argv[arg+3]);
+	} else {
+	    goto usage;
+	}
+    }
+
+    if (argc - arg != 2)
+	goto usage;
+    return Compare(argv[arg], argv[arg+1], match, quiet);
+
+ usage:
+
+    printf("Usage: %s [--position] [-q] old.pdb new.pdb\n"
+	   "       %s --patch patchfile old.pdb new.pdb\n"
+	   "       %s --apply patchfile old.pdb out.pdb\n\n"
+	   "  Lists the records added, removed or changed between two databases,\n"
+	   "  and any header fields that differ. Records are matched up by unique\n"
+	   "  ID (resources by type and ID) and compared by hash.\n"
+	   "  Exits with 0 if the databases are the same, 1 if they differ and 2\n"
+	   "  on trouble.\n\n"
+	   "    --position  matches records by position instead\n"
+	   "    -q          only says whether the databases differ\n"
+	   "    --patch     writes a binary patch that turns old.pdb into new.pdb\n"
+	   "    --apply     applies such a patch to old.pdb, writing out.pdb\n\n"
+	   "This program has no warranty.\n"
+	   "Please report bugs to John R. Hall <kg4ruo@arrl.net>.\n",
+	   argv[0], argv[0], argv[0]);
+
+    return TROUBLE;
+}
@@ -14,92 +14,738 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "palmpdb.h"
 
-static void ShowPDBInfo(PDB* pdb)
+#define BATCH_DEFAULT_THREADS  4
+#define BATCH_WINDOW_PER_THREAD 16
+#define CAT_CACHE_BYTES        (1024 * 1024)
+#define DUMP_BATCH             64       /* records a dump thread takes at a time */
+#define TAR_BLOCK              512
+#define TAR_BATCH              256      /* files gathered into each writev */
+#define PALM_EPOCH_OFFSET      2082844800UL   /* seconds from 1904 to 1970 */
+
+static void ShowPDBInfo(FILE* out, PDB* pdb)
 {
     unsigned int r;
 
-    printf("Title:         %s\n", pdb->name);
-    printf("Attributes:    %Xh (%s, %s, %s, %s, %s, %s)\n", pdb->attributes,
-	   pdb->attributes & PDB_ATTR_READONLY ? "read only": "read-write",
-	   pdb->attributes & PDB_ATTR_DIRTY_APPINFO ? "dirty appinfo": "clean appinfo",
-	   pdb->attributes & PDB_ATTR_BACKUP ? "back up": "don't back up",
-	   pdb->attributes & PDB_ATTR_OVERWRITE ? "overwrite older": "don't overwrite older",
-	   pdb->attributes & PDB_ATTR_FORCE_RESET ? "reset after install": "don't reset after install",
-	   pdb->attributes & PDB_ATTR_COPY_PREVENT ? "copy prevent": "no copy prevent");
-    printf("Records:       %u\n", pdb->num_records);
-    printf("Version:       %u\n", pdb->version);
-    printf("Creation time: %u\n", pdb->creation_time);
-    printf("Mod time:      %u\n", pdb->modification_time);
-    printf("Backup time:   %u\n", pdb->backup_time);
-    printf("Type ID:       %s\n", pdb->type);
-    printf("Creator ID:    %s\n", pdb->creator);
-    printf("App info:      %u bytes\n", pdb->app_info_length);
+    fprintf(out, "Title:         %s\n", pdb->name);
+    fprintf(out, "Attributes:    %Xh (%s, %s, %s, %s, %s, %s)\n", pdb->attributes,
+	    pdb->attributes & PDB_ATTR_READONLY ? "read only": "read-write",
+	    pdb->attributes & PDB_ATTR_DIRTY_APPINFO ? "dirty appinfo": "clean appinfo",
+	    pdb->attributes & PDB_ATTR_BACKUP ? "back up": "don't back up",
+	    pdb->attributes & PDB_ATTR_OVERWRITE ? "overwrite older": "don't overwrite older",
+	    pdb->attributes & PDB_ATTR_FORCE_RESET ? "reset after install": "don't reset after install",
+	    pdb->attributes & PDB_ATTR_COPY_PREVENT ? "copy prevent": "no copy prevent");
+    fprintf(out, "Records:       %u\n", pdb->num_records);
+    fprintf(out, "Version:       %u\n", pdb->version);
+    fprintf(out, "Creation time: %u\n", pdb->creation_time);
+    fprintf(out, "Mod time:      %u\n", pdb->modification_time);
+    fprintf(out, "Backup time:   %u\n", pdb->backup_time);
+    fprintf(out, "Type ID:       %s\n", pdb->type);
+    fprintf(out, "Creator ID:    %s\n", pdb->creator);
+    fprintf(out, "App info:      %u bytes\n", pdb->app_info_length);
+    fprintf(out, "Sort info:     %u bytes\n", pdb->sort_info_length);
+    fprintf(out, "UID seed:      %u\n", pdb->unique_id_seed);
 
     for (r = 0; r < pdb->num_records; r++) {
-	printf("  Record %i:\n", r);
-	printf("    Length: %i\n", pdb->records[r].length);
-	printf("    Attr:   %Xh (%s, %s, %s, %s)\n", pdb->records[r].attributes,
-	       pdb->records[r].attributes & PDB_REC_SECRET ? "secret" : "not secret",
-	       pdb->records[r].attributes & PDB_REC_BUSY ? "busy" : "not busy",
-	       pdb->records[r].attributes & PDB_REC_DELETED ? "deleted" : "not deleted",
-	       pdb->records[r].attributes & PDB_REC_DIRTY ? "dirty" : "not dirty");
+	fprintf(out, "  Record %i:\n", r);
+	fprintf(out, "    Length: %i\n", pdb->records[r].length);
+	if (pdb->attributes & PDB_ATTR_RESOURCE) {
+	    fprintf(out, "    Type:   %s\n", pdb->records[r].resource_type);
+	    fprintf(out, "    ID:     %u\n", pdb->records[r].resource_id);
+	    continue;
+	}
+	fprintf(out, "    UID:    %06Xh\n", pdb->records[r].unique_id);
+	fprintf(out, "    Attr:   %Xh (%s, %s, %s, %s)\n", pdb->records[r].attributes,
+	        pdb->records[r].attributes & PDB_REC_SECRET ? "secret" : "not secret",
+	        pdb->records[r].attributes & PDB_REC_BUSY ? "busy" : "not busy",
+	        pdb->records[r].attributes & PDB_REC_DELETED ? "deleted" : "not deleted",
+	        pdb->records[r].attributes & PDB_REC_DIRTY ? "dirty" : "not dirty");
+    }
+}
+
+static void PrintStats(void)
+{
+    PDB_Stats stats;
+
+    PDB_GetStats(&stats);
+    printf("Library stats:\n");
+    printf("Bytes read:    %lu in %lu calls\n", stats.bytes_read, stats.read_calls);
+    printf("Bytes written: %lu in %lu calls\n", stats.bytes_written, stats.write_calls);
+    printf("Seeks:         %lu\n", stats.seek_calls);
+    printf("Allocations:   %lu malloc, %lu realloc, %lu bytes\n",
+	   stats.malloc_calls, stats.realloc_calls, stats.bytes_allocated);
+    printf("Header parse:  %.3f ms\n", stats.header_parse_ns / 1e6);
+    printf("Index parse:   %.3f ms\n", stats.index_parse_ns / 1e6);
+    printf("Body load:     %.3f ms\n", stats.body_load_ns / 1e6);
+    printf("Body store:    %.3f ms\n", stats.body_store_ns / 1e6);
+}
+
+/* Writes a whole file into directory dirfd, with one open, write and
+   close. Returns 0 on success, -1 on failure. */
+static int WriteFileAt(int dirfd, const char* name, const void* data, unsigned int length)
+{
+    ssize_t done;
+    int fd;
+
+    fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+	return -1;
+    while (length > 0) {
+	done = write(fd, data, length);
+	if (done < 0 && errno == EINTR)
+	    continue;
+	if (done <= 0) {
+	    close(fd);
+	    return -1;
+	}
+	data = (const char *)data + done;
+	length -= done;
+    }
+    return close(fd);
+}
+
+/* Records of a dump to a directory, handed out DUMP_BATCH at a time to
+   a pool of threads. The database is mapped, so its records can be read
+   from any thread. */
+typedef struct DumpPool {
+    PDB* pdb;
+    int dirfd;
+    unsigned int next;
+    unsigned int failed;
+    pthread_mutex_t lock;
+} DumpPool;
+
+static void* DumpWorker(void* arg)
+{
+    DumpPool* pool = (DumpPool *)arg;
+    PDB* pdb = pool->pdb;
+    unsigned int first, i;
+    char name[32];
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	first = pool->next;
+	if (first < pdb->num_records)
+	    pool->next += DUMP_BATCH;
+	pthread_mutex_unlock(&pool->lock);
+	if (first >= pdb->num_records)
+	    break;
+
+	for (i = first; i < first + DUMP_BATCH && i < pdb->num_records; i++) {
+	    snprintf(name, sizeof (name), "record%u", i);
+	    if (WriteFileAt(pool->dirfd, name, pdb->records[i].data, pdb->records[i].length) < 0) {
+		printf("WARNING: unable to write '%s'.\n", name);
+		pthread_mutex_lock(&pool->lock);
+		pool->failed++;
+		pthread_mutex_unlock(&pool->lock);
+	    }
+	}
+    }
+    return NULL;
+}
+
+/* Dumps the AppInfo and SortInfo blocks and every record to files in
+   dir, the records on num_threads threads. */
+static int DumpToDirectory(PDB* pdb, const char* dir, int num_threads)
+{
+    pthread_t* threads;
+    DumpPool pool;
+    int i, started = 0;
+
+    memset(&pool, 0, sizeof (pool));
+    pool.pdb = pdb;
+    pool.dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (pool.dirfd < 0) {
+	printf("Unable to open directory '%s'.\n", dir);
+	return -1;
+    }
+
+    if (pdb->app_info_length > 0 &&
+	WriteFileAt(pool.dirfd, "appinfo", pdb->app_info_block, pdb->app_info_length) < 0) {
+	printf("WARNING: unable to write 'appinfo'.\n");
+	pool.failed++;
+    }
+    if (pdb->sort_info_length > 0 &&
+	WriteFileAt(pool.dirfd, "sortinfo", pdb->sort_info_block, pdb->sort_info_length) < 0) {
+	printf("WARNING: unable to write 'sortinfo'.\n");
+	pool.failed++;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    threads = (num_threads > 1 ? (pthread_t *)malloc(num_threads * sizeof (pthread_t)) : NULL);
+    if (threads != NULL) {
+	for (i = 0; i < num_threads; i++) {
+	    if (pthread_create(&threads[started], NULL, DumpWorker, &pool) == 0)
+		started++;
+	}
+    }
+    /* Whatever threads can't be started, this one makes up for. */
+    DumpWorker(&pool);
+    for (i = 0; i < started; i++) {
+	pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    close(pool.dirfd);
+
+    return (pool.failed == 0 ? 0 : -1);
+}
+
+/* A ustar archive going to a file descriptor. Headers, record data
+   (straight out of the mapping) and padding are gathered TAR_BATCH files
+   at a time into a single writev. */
+typedef struct TarStream {
+    int fd;
+    unsigned long mtime;
+    unsigned char headers[TAR_BATCH][TAR_BLOCK];
+    struct iovec iov[3 * TAR_BATCH + 1];
+    int num_headers, num_iov;
+} TarStream;
+
+static const unsigned char tar_zeros[2 * TAR_BLOCK];
+
+static int WriteAllV(int fd, struct iovec* iov, int count)
+{
+    ssize_t done;
+
+    while (count > 0) {
+	done = writev(fd, iov, count);
+	if (done < 0 && errno == EINTR)
+	    continue;
+	if (done < 0)
+	    return -1;
+	while (count > 0 && (size_t)done >= iov->iov_len) {
+	    done -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	if (count > 0) {
+	    iov->iov_base = (char *)iov->iov_base + done;
+	    iov->iov_len -= done;
+	}
+    }
+    return 0;
+}
+
+static int TarFlush(TarStream* tar)
+{
+    int result = WriteAllV(tar->fd, tar->iov, tar->num_iov);
+
+    tar->num_headers = 0;
+    tar->num_iov = 0;
+    return result;
+}
+
+/* Adds a regular file, owned by root and readable by all. */
+static int TarAdd(TarStream* tar, const char* name, const void* data, unsigned int length)
+{
+    unsigned char* h = tar->headers[tar->num_headers++];
+    unsigned int sum = 0, i;
+
+    memset(h, 0, TAR_BLOCK);
+    strncpy((char *)h, name, 99);
+    memcpy(h + 100, "0000644", 7);
+    memcpy(h + 108, "0000000", 7);
+    memcpy(h + 116, "0000000", 7);
+    snprintf((char *)h + 124, 12, "%011o", length);
+    snprintf((char *)h + 136, 12, "%011lo", tar->mtime);
+    memset(h + 148, ' ', 8);        /* the checksum counts itself as spaces */
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    for (i = 0; i < TAR_BLOCK; i++) {
+	sum += h[i];
+    }
+    snprintf((char *)h + 148, 8, "%06o", sum);
+
+    tar->iov[tar->num_iov].iov_base = h;
+    tar->iov[tar->num_iov++].iov_len = TAR_BLOCK;
+    if (length > 0) {
+	tar->iov[tar->num_iov].iov_base = (void *)data;
+	tar->iov[tar->num_iov++].iov_len = length;
+    }
+    if (length % TAR_BLOCK != 0) {
+	tar->iov[tar->num_iov].iov_base = (void *)tar_zeros;
+	tar->iov[tar->num_iov++].iov_len = TAR_BLOCK - length % TAR_BLOCK;
+    }
+    return (tar->num_headers == TAR_BATCH ? TarFlush(tar) : 0);
+}
+
+/* Streams the AppInfo and SortInfo blocks and every record to stdout as
+   one tar archive, with the same names a dump to a directory has. */
+static int DumpToTar(PDB* pdb)
+{
+    TarStream* tar;
+    char name[32];
+    unsigned int i;
+    int result = 0;
+
+    tar = (TarStream *)malloc(sizeof (TarStream));
+    if (tar == NULL)
+	return -1;
+    tar->fd = STDOUT_FILENO;
+    tar->mtime = (pdb->modification_time > PALM_EPOCH_OFFSET ?
+		  pdb->modification_time - PALM_EPOCH_OFFSET : 0);
+    tar->num_headers = 0;
+    tar->num_iov = 0;
+
+    if (pdb->app_info_length > 0)
+	result |= TarAdd(tar, "appinfo", pdb->app_info_block, pdb->app_info_length);
+    if (pdb->sort_info_length > 0)
+	result |= TarAdd(tar, "sortinfo", pdb->sort_info_block, pdb->sort_info_length);
+    for (i = 0; i < pdb->num_records && result == 0; i++) {
+	snprintf(name, sizeof (name), "record%u", i);
+	result = TarAdd(tar, name, pdb->records[i].data, pdb->records[i].length);
+    }
+
+    /* Two empty blocks end the archive. */
+    if (result == 0) {
+	tar->iov[tar->num_iov].iov_base = (void *)tar_zeros;
+	tar->iov[tar->num_iov++].iov_len = sizeof (tar_zeros);
+	result = TarFlush(tar);
+    }
+
+    free(tar);
+    if (result != 0)
+	fprintf(stderr, "Unable to write the archive.\n");
+    return result;
+}
+
+/* pdbinfo dump filename.pdb [--tar | [-d dir] [-j threads]] */
+static int Dump(int argc, char *argv[], int show_stats)
+{
+    const char* dir = ".";
+    int num_threads = BATCH_DEFAULT_THREADS;
+    int tar = 0;
+    int arg, result;
+    PDB pdb;
+
+    for (arg = 1; arg < argc; arg++) {
+	if (!strcmp(argv[arg], "--tar")) {
+	    tar = 1;
+	} else if (!strcmp(argv[arg], "-d") && arg < argc-1) {
+	    dir = argv[++arg];
+	} else if (!strcmp(argv[arg], "-j") && arg < argc-1) {
+	    num_threads = atoi(argv[++arg]);
+	    if (num_threads < 1)
+		num_threads = 1;
+	} else {
+	    printf("'%s'? You speak nonsense.\n", argv[arg]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+    if (PDB_MapFile(&pdb, argv[0]) < 0) {
+	fprintf(tar ? stderr : stdout, "Unable to read '%s'.\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+    result = (tar ? DumpToTar(&pdb) : DumpToDirectory(&pdb, dir, num_threads));
+    PDB_Free(&pdb);
+
+    /* A tar goes to stdout, so there are no stats to go with it. */
+    if (show_stats && !tar)
+	PrintStats();
+    return (result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* A single file of a --batch run. Workers fill in the report; the main
+   thread prints reports strictly in input order. */
+typedef struct BatchItem {
+    const char* filename;
+    char* report;
+    size_t report_length;
+    int ok;
+    unsigned int num_records;
+    unsigned long bytes;
+    char type[5];
+    char creator[5];
+    int done;
+} BatchItem;
+
+typedef struct Batch {
+    BatchItem* items;
+    unsigned int num_items;
+    unsigned int next;          /* next item a worker should take */
+    unsigned int printed;       /* items already printed */
+    unsigned int window;        /* how far workers may run ahead of printing */
+    pthread_mutex_t lock;
+    pthread_cond_t item_done;
+    pthread_cond_t item_printed;
+} Batch;
+
+typedef struct Histogram {
+    char id[5];
+    unsigned int count;
+} Histogram;
+
+static void ShowBatchItem(BatchItem* item)
+{
+    FILE* out;
+    PDB pdb;
+    unsigned int r;
+
+    out = open_memstream(&item->report, &item->report_length);
+    if (out == NULL)
+	return;
+
+    fprintf(out, "File:          %s\n", item->filename);
+    if (PDB_ReadHeader(&pdb, item->filename) < 0) {
+	fprintf(out, "Unable to read '%s'.\n", item->filename);
+    } else {
+	ShowPDBInfo(out, &pdb);
+	item->ok = 1;
+	item->num_records = pdb.num_records;
+	item->bytes = pdb.app_info_length + pdb.sort_info_length;
+	for (r = 0; r < pdb.num_records; r++) {
+	    item->bytes += pdb.records[r].length;
+	}
+	memcpy(item->type, pdb.type, sizeof (item->type));
+	memcpy(item->creator, pdb.creator, sizeof (item->creator));
+	PDB_Free(&pdb);
+    }
+    fprintf(out, "\n");
+    fclose(out);
+}
+
+static void* BatchWorker(void* arg)
+{
+    Batch* batch = (Batch *)arg;
+    unsigned int i;
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->next < batch->num_items) {
+	/* Don't run too far ahead of the printer, or reports pile up. */
+	if (batch->next >= batch->printed + batch->window) {
+	    pthread_cond_wait(&batch->item_printed, &batch->lock);
+	    continue;
+	}
+	i = batch->next++;
+	pthread_mutex_unlock(&batch->lock);
+
+	ShowBatchItem(&batch->items[i]);
+
+	pthread_mutex_lock(&batch->lock);
+	batch->items[i].done = 1;
+	pthread_cond_broadcast(&batch->item_done);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+static void CountID(Histogram** hist, unsigned int* num, const char* id)
+{
+    Histogram* grown;
+    unsigned int i;
+
+    for (i = 0; i < *num; i++) {
+	if (!memcmp((*hist)[i].id, id, 4)) {
+	    (*hist)[i].count++;
+	    return;
+	}
     }
+    grown = (Histogram *)realloc(*hist, (*num + 1) * sizeof (Histogram));
+    if (grown == NULL)
+	return;
+    *hist = grown;
+    memcpy(grown[*num].id, id, 4);
+    grown[*num].id[4] = '\0';
+    grown[*num].count = 1;
+    (*num)++;
+}
+
+static int CompareHistogram(const void* a, const void* b)
+{
+    const Histogram* ha = (const Histogram *)a;
+    const Histogram* hb = (const Histogram *)b;
+
+    if (ha->count != hb->count)
+	return (ha->count < hb->count ? 1 : -1);
+    return memcmp(ha->id, hb->id, 4);
 }
 
-static void DumpPDB(PDB* pdb)
+static void PrintHistogram(const char* title, Histogram* hist, unsigned int num)
 {
-    FILE *f;
     unsigned int i;
 
-    if (pdb->app_info_length > 0) {
-	f = fopen("appinfo", "wb");
-	if (f == NULL) {
-	    printf("WARNING: unable to open 'appinfo'.\n");
+    qsort(hist, num, sizeof (Histogram), CompareHistogram);
+    printf("%s\n", title);
+    for (i = 0; i < num; i++) {
+	printf("  %-4s  %u\n", hist[i].id, hist[i].count);
+    }
+}
+
+/* Reads file names, one per line, from stdin. Returns -1 if stdin can't
+   be read or a name can't be stored; the names read so far are kept. */
+static int ReadFileList(char*** names, unsigned int* num)
+{
+    char* line = NULL;
+    char* name;
+    size_t size = 0;
+    ssize_t length;
+    unsigned int capacity = *num;
+    int result = 0;
+
+    while ((length = getline(&line, &size, stdin)) > 0) {
+	if (line[length-1] == '\n')
+	    line[--length] = '\0';
+	if (length == 0)
+	    continue;
+	if (*num == capacity) {
+	    char** grown;
+	    capacity = (capacity > 0 ? capacity * 2 : 256);
+	    grown = (char **)realloc(*names, capacity * sizeof (char *));
+	    if (grown == NULL) {
+		result = -1;
+		break;
+	    }
+	    *names = grown;
+	}
+	name = strdup(line);
+	if (name == NULL) {
+	    result = -1;
+	    break;
+	}
+	(*names)[(*num)++] = name;
+    }
+    free(line);
+    return (ferror(stdin) ? -1 : result);
+}
+
+static int ShowBatch(int argc, char *argv[])
+{
+    char** names = NULL;
+    unsigned int num_names = 0, num_owned = 0;
+    int num_threads = BATCH_DEFAULT_THREADS;
+    Histogram* types = NULL;
+    Histogram* creators = NULL;
+    unsigned int num_types = 0, num_creators = 0;
+    unsigned long total_records = 0, total_bytes = 0;
+    unsigned int unreadable = 0;
+    pthread_t* threads;
+    Batch batch;
+    int arg, started = 0, read_stdin = 0, list_failed = 0;
+    unsigned int i;
+
+    names = (char **)malloc((argc + 1) * sizeof (char *));
+    if (names == NULL)
+	return EXIT_FAILURE;
+
+    for (arg = 0; arg < argc; arg++) {
+	if (!strcmp(argv[arg], "-j") && arg < argc-1) {
+	    num_threads = atoi(argv[++arg]);
+	    if (num_threads < 1)
+		num_threads = 1;
+	} else if (!strcmp(argv[arg], "-")) {
+	    read_stdin = 1;
 	} else {
-	    fwrite(pdb->app_info_block, pdb->app_info_length, 1, f);
-	    fclose(f);
+	    names[num_names++] = argv[arg];
 	}
     }
 
-    for (i = 0; i < pdb->num_records; i++) {
-	char name[13];
-	snprintf(name, 12, "record%i", i); name[12] = '\0';
-	f = fopen(name, "wb");
-	if (f == NULL) {
-	    printf("WARNING: unable to open '%s'.\n", name);
+    /* Names from stdin go after the ones on the command line; only those
+       were strdup'd. */
+    num_owned = num_names;
+    if (read_stdin && ReadFileList(&names, &num_names) < 0) {
+	printf("WARNING: error reading file list from stdin.\n");
+	list_failed = 1;
+    }
+
+    memset(&batch, 0, sizeof (batch));
+    batch.items = (BatchItem *)calloc(num_names > 0 ? num_names : 1, sizeof (BatchItem));
+    if (batch.items == NULL)
+	return EXIT_FAILURE;
+    for (i = 0; i < num_names; i++) {
+	batch.items[i].filename = names[i];
+    }
+    batch.num_items = num_names;
+    batch.window = num_threads * BATCH_WINDOW_PER_THREAD;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.item_done, NULL);
+    pthread_cond_init(&batch.item_printed, NULL);
+
+    threads = (pthread_t *)malloc(num_threads * sizeof (pthread_t));
+    if (threads != NULL) {
+	for (arg = 0; arg < num_threads; arg++) {
+	    if (pthread_create(&threads[started], NULL, BatchWorker, &batch) == 0)
+		started++;
+	}
+    }
+    if (started == 0) {
+	/* No threads at all; do the work here, which also prints in order. */
+	batch.window = num_names + 1;
+	BatchWorker(&batch);
+    }
+
+    for (i = 0; i < num_names; i++) {
+	BatchItem* item = &batch.items[i];
+
+	pthread_mutex_lock(&batch.lock);
+	while (!item->done)
+	    pthread_cond_wait(&batch.item_done, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+
+	if (item->report != NULL)
+	    fwrite(item->report, item->report_length, 1, stdout);
+	free(item->report);
+
+	if (item->ok) {
+	    total_records += item->num_records;
+	    total_bytes += item->bytes;
+	    CountID(&types, &num_types, item->type);
+	    CountID(&creators, &num_creators, item->creator);
 	} else {
-	    fwrite(pdb->records[i].data, pdb->records[i].length, 1, f);
-	    fclose(f);
+	    unreadable++;
 	}
+
+	pthread_mutex_lock(&batch.lock);
+	batch.printed = i + 1;
+	pthread_cond_broadcast(&batch.item_printed);
+	pthread_mutex_unlock(&batch.lock);
+    }
+
+    for (arg = 0; arg < started; arg++) {
+	pthread_join(threads[arg], NULL);
+    }
+
+    printf("Summary:\n");
+    printf("Files:         %u\n", num_names);
+    printf("Unreadable:    %u\n", unreadable);
+    printf("Records:       %lu\n", total_records);
+    printf("Data bytes:    %lu\n", total_bytes);
+    PrintHistogram("Type IDs:", types, num_types);
+    PrintHistogram("Creator IDs:", creators, num_creators);
+
+    pthread_cond_destroy(&batch.item_printed);
+    pthread_cond_destroy(&batch.item_done);
+    pthread_mutex_destroy(&batch.lock);
+    for (i = num_owned; i < num_names; i++) {
+	free(names[i]);
+    }
+    free(names);
+    free(batch.items);
+    free(threads);
+    free(types);
+    free(creators);
+
+    return (unreadable == 0 && !list_failed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static long StdoutWrite(void* ctx, const void* buf, unsigned long length)
+{
+    size_t done = fwrite(buf, 1, length, (FILE *)ctx);
+
+    return (done == 0 ? -1 : (long)done);
+}
+
+/* Writes records first to first+count-1 (all from first on, if count is
+   NULL) to stdout, back to back, as makepdb --chunk split a file into
+   them. The database is opened lazily, so it's never whole in memory. */
+static int CatRecords(const char* filename, const char* first_arg, const char* count_arg)
+{
+    unsigned long first = 0, count;
+    PDB_IO io;
+    PDB pdb;
+    int result;
+
+    if (PDB_OpenLazy(&pdb, filename, CAT_CACHE_BYTES) < 0) {
+	fprintf(stderr, "Unable to read '%s'.\n", filename);
+	return EXIT_FAILURE;
     }
+    if (first_arg != NULL)
+	first = strtoul(first_arg, NULL, 10);
+    count = (first < pdb.num_records ? pdb.num_records - first : 0);
+    if (count_arg != NULL)
+	count = strtoul(count_arg, NULL, 10);
+    /* Checked here, while they're still unsigned long; the library takes
+       unsigned int and would see them wrapped. */
+    if (first > pdb.num_records || count > pdb.num_records - first) {
+	fprintf(stderr, "Asked for %lu records from record %lu, but '%s' has %u.\n", count, first, filename, pdb.num_records);
+	PDB_Free(&pdb);
+	return EXIT_FAILURE;
+    }
+
+    memset(&io, 0, sizeof (io));
+    io.write = StdoutWrite;
+    io.ctx = stdout;
+    result = PDB_WriteRecordsToIO(&pdb, first, count, &io);
+    if (result < 0 || fflush(stdout) != 0) {
+	fprintf(stderr, "Unable to write records %lu to %lu of '%s'.\n", first, first + count - 1, filename);
+	result = -1;
+    }
+
+    PDB_Free(&pdb);
+    return (result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
+    int show_stats = 0;
+    int result;
     PDB pdb;
 
+    if (argc > 1 && !strcmp(argv[1], "--stats")) {
+	show_stats = 1;
+	PDB_EnableStats(1);
+	argv[1] = argv[0];
+	argc--;
+	argv++;
+    }
+
     if (argc < 3) {
-	printf("Usage: %s command filename.pdb\n\n", argv[0]);
+	printf("Usage: %s [--stats] command filename.pdb\n", argv[0]);
+	printf("       %s [--stats] show --batch [-j threads] files... [-]\n", argv[0]);
+	printf("       %s [--stats] dump filename.pdb [-d dir] [-j threads]\n", argv[0]);
+	printf("       %s dump filename.pdb --tar > records.tar\n", argv[0]);
+	printf("       %s cat filename.pdb [first [count]]\n\n", argv[0]);
 	printf("  command is one of the following:\n"
 	       "    show   Shows all available info about the database.\n"
-	       "    dump   Dumps all records to files.\n\n"
+	       "           With --batch, shows any number of databases (reading more\n"
+	       "           names from stdin if - is given) on a pool of threads, in\n"
+	       "           order, followed by totals and type/creator histograms.\n"
+	       "    dump   Dumps all records to files, record0, record1... (and the\n"
+	       "           AppInfo and SortInfo blocks to appinfo and sortinfo) in\n"
+	       "           the current directory or dir, on a pool of threads.\n"
+	       "           With --tar, streams the same files to stdout as one tar\n"
+	       "           archive instead.\n"
+	       "    cat    Writes the records' data to stdout back to back, putting\n"
+	       "           together a file that makepdb --chunk split up. Takes\n"
+	       "           the first record and the number of records to write;\n"
+	       "           the rest of the database by default.\n\n"
+	       "  --stats prints the library's I/O, allocation and timing counters\n"
+	       "  at the end.\n\n"
 	       "This program has no warranty.\n"
 	       "Please report bugs to John R. Hall <kg4ruo@arrl.net>.\n");
 	       
 	return EXIT_FAILURE;
     }
 
-    if (PDB_ReadFile(&pdb, argv[2]) < 0) {
+    if (!strcmp(argv[1], "show") && !strcmp(argv[2], "--batch")) {
+	result = ShowBatch(argc - 3, argv + 3);
+	if (show_stats)
+	    PrintStats();
+	return result;
+    }
+
+    /* The output is the data, so there are no stats to go with it. */
+    if (!strcmp(argv[1], "cat"))
+	return CatRecords(argv[2], argc > 3 ? argv[3] : NULL, argc > 4 ? argv[4] : NULL);
+    if (!strcmp(argv[1], "dump"))
+	return Dump(argc - 2, argv + 2, show_stats);
+
+    /* Showing a database takes nothing past its record list. */
+    if (PDB_ReadHeader(&pdb, argv[2]) < 0) {
 	printf("Unable to read '%s'.\n", argv[2]);
 	return EXIT_FAILURE;
     }
 
     if (!strcmp(argv[1], "show")) {
-	ShowPDBInfo(&pdb);
-    } else if (!strcmp(argv[1], "dump")) {
-	DumpPDB(&pdb);
+	ShowPDBInfo(stdout, &pdb);
     } else {
 	printf("'%s'? You speak nonsense.\n", argv[1]);
 	PDB_Free(&pdb);
@@ -107,6 +753,8 @@ int main(int argc, char *argv[])
     }
 
     PDB_Free(&pdb);
+    if (show_stats)
+	PrintStats();
 
     return EXIT_SUCCESS;
 }